@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import json
 import os
 import sys
 import re
@@ -189,6 +190,75 @@ class MemoryTest():
         sys.stdout.flush()
         return (process.returncode == 0)
 
+    def run_benchmark(self):
+        """Run threaded_memtest -B and return its key: value results"""
+        self._get_memory()
+        memory = min(self.free_memory // 2, 2048)  # MB
+        command = "%s -q -B -m%um -n%u" % (
+            self.threaded_memtest_script, memory, os.cpu_count() or 1)
+        print("Command is: %s" % command)
+        process = self._command(command)
+        output = process.communicate()[0].decode()
+        if process.returncode != 0:
+            print("%s returned code %s" % (self.threaded_memtest_script,
+                  process.returncode), file=sys.stderr)
+            return None
+        results = {}
+        for line in output.splitlines():
+            match = re.match(r"^(\S+): (.*)$", line)
+            if not match:
+                continue
+            key, value = match.groups()
+            try:
+                results[key] = float(value)
+            except ValueError:
+                # latency histograms: "<1:0 <2:10 ... >=2048:0"
+                results[key] = dict(b.split(":") for b in value.split())
+        return results
+
+    @staticmethod
+    def baseline_path(path):
+        """A baseline file, or a directory of them named after the model"""
+        if not os.path.isdir(path):
+            return path
+        try:
+            with open("/sys/class/dmi/id/product_name") as f:
+                model = f.read().strip()
+        except OSError:
+            model = "unknown"
+        return os.path.join(path, "%s.json" % model.replace("/", "_"))
+
+    @staticmethod
+    def compare_baseline(results, baseline, tolerance):
+        """
+        Compare the aggregate figures to the baseline, bandwidth (MBps) may
+        not drop and latency (ns) may not grow by more than tolerance
+        percent. Per-thread figures are too noisy to be compared.
+        """
+        passed = True
+        for key, expected in sorted(baseline.items()):
+            if key.startswith("thread_") or not isinstance(expected, float):
+                continue
+            if key.endswith("_MBps"):
+                ratio = (results.get(key, 0) / expected) if expected else 1
+                worse = ratio < 1 - tolerance / 100
+            elif key.endswith("_ns"):
+                ratio = (results.get(key, 0) / expected) if expected else 1
+                worse = ratio > 1 + tolerance / 100
+            else:
+                continue
+            if key not in results:
+                print("ERROR: %s missing from the results" % key,
+                      file=sys.stderr)
+                passed = False
+                continue
+            print("%s: %.2f (baseline %.2f, %+.1f%%)%s" % (
+                  key, results[key], expected, (ratio - 1) * 100,
+                  " FAILED" if worse else ""))
+            if worse:
+                passed = False
+        return passed
+
     def run_processes(self, number, command):
         passed = True
         pipe = []
@@ -225,6 +295,17 @@ def main(args):
     parser = ArgumentParser()
     parser.add_argument("-q", "--quiet", action="store_true",
                         help="Suppress output.")
+    parser.add_argument("--benchmark", action="store_true",
+                        help="Measure bandwidth and latency instead of "
+                             "testing the memory.")
+    parser.add_argument("--baseline", metavar="PATH",
+                        help="JSON file (or directory of <product name>.json "
+                             "files) to compare the benchmark against.")
+    parser.add_argument("--save-baseline", metavar="PATH",
+                        help="Save the benchmark results as a baseline.")
+    parser.add_argument("--tolerance", type=float, default=10,
+                        help="Allowed regression from the baseline, in "
+                             "percent (default: %(default)s).")
     args = parser.parse_args(args)
 
     if args.quiet:
@@ -232,7 +313,30 @@ def main(args):
         sys.stderr = open(os.devnull, 'a')
 
     test = MemoryTest()
-    return test.run()
+    if not args.benchmark:
+        return test.run()
+
+    results = test.run_benchmark()
+    if results is None:
+        print("Memory benchmark failed", file=sys.stderr)
+        return 1
+    print(json.dumps(results, indent=2, sort_keys=True))
+    if args.save_baseline:
+        with open(test.baseline_path(args.save_baseline), "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    if args.baseline:
+        path = test.baseline_path(args.baseline)
+        try:
+            with open(path) as f:
+                baseline = json.load(f)
+        except (OSError, ValueError) as e:
+            print("ERROR: could not load baseline %s: %s" % (path, e),
+                  file=sys.stderr)
+            return 1
+        if not test.compare_baseline(results, baseline, args.tolerance):
+            print("Memory benchmark is below the baseline", file=sys.stderr)
+            return 1
+    return 0
 
 
 if __name__ == "__main__":
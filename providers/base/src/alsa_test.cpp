@@ -1,36 +1,499 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <condition_variable>
 #include <cstring>
+#include <future>
+#include <functional>
 #include <iostream>
 #include <istream>
 #include <iterator>
 #include <limits>
 #include <map>
+#include <set>
 #include <string>
 #include <sstream>
 #include <thread>
+#include <type_traits>
 #include <vector>
 #include <alsa/asoundlib.h>
 #include <complex>
-#include <valarray>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <pthread.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-typedef std::valarray<std::complex<float>> CArray;
-void fft(CArray& x)
-{
-    // almost the same implementation as one on rosetta code
-    const size_t N = x.size();
-    if (N <= 1) return;
-    CArray even = x[std::slice(0, N/2, 2)];
-    CArray odd = x[std::slice(1, N/2, 2)];
-    fft(even);
-    fft(odd);
-    for (size_t k = 0; k < N/2; ++k) {
-        auto t = std::polar(1.0f, -2 * float(M_PI) * k / N) * odd[k];
-        x[k] = even[k] + t;
-        x[k+N/2] = even[k] - t;
+namespace Dsp {
+
+typedef std::complex<float> Complex;
+
+// std::complex's operator* goes through the C99 Annex G NaN handling
+// (__mulsc3), which is way too slow for a butterfly loop
+inline Complex cmul(const Complex a, const Complex b) {
+    return Complex(a.real() * b.real() - a.imag() * b.imag(),
+                   a.real() * b.imag() + a.imag() * b.real());
+}
+
+inline size_t next_pow2(size_t n) {
+    size_t result = 1;
+    while (result < n) result <<= 1;
+    return result;
+}
+
+// Plans are expensive to build and never change, so keep one per size around
+template<class Plan>
+const Plan& cached_plan(size_t n) {
+    static std::mutex cache_mutex;
+    static std::map<size_t, std::unique_ptr<Plan>> cache;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto &plan = cache[n];
+    if (!plan) plan.reset(new Plan(n));
+    return *plan;
+}
+
+// In-place, iterative radix-2 FFT of a fixed (power of two) size.
+// Twiddle factors are computed once when the plan is created, so transform()
+// performs no allocations and no trigonometry. A plan is immutable after
+// construction and can be shared by multiple threads; use FftPlan::get() to
+// obtain a cached plan for a given size.
+struct FftPlan {
+    explicit FftPlan(size_t n) : n(n), twiddles(n / 2) {
+        if (n == 0 || (n & (n - 1)))
+            throw std::invalid_argument("FFT size has to be a power of two");
+        for (size_t k = 0; k < n / 2; ++k) {
+            // computed in double precision, so the table is accurate even
+            // for long transforms
+            double phase = -2.0 * M_PI * double(k) / double(n);
+            twiddles[k] = Complex(float(cos(phase)), float(sin(phase)));
+        }
+    }
+    size_t size() const { return this->n; }
+    void transform(Complex *data) const {
+        // bit-reversal permutation
+        for (size_t i = 1, j = 0; i < n; ++i) {
+            size_t bit = n >> 1;
+            for (; j & bit; bit >>= 1) j ^= bit;
+            j ^= bit;
+            if (i < j) std::swap(data[i], data[j]);
+        }
+        // butterflies, smallest transforms first
+        for (size_t len = 2; len <= n; len <<= 1) {
+            const size_t half = len / 2;
+            const size_t stride = n / len;
+            for (size_t start = 0; start < n; start += len) {
+                Complex *lo = data + start;
+                Complex *hi = lo + half;
+                for (size_t k = 0; k < half; ++k) {
+                    Complex t = cmul(twiddles[k * stride], hi[k]);
+                    hi[k] = lo[k] - t;
+                    lo[k] += t;
+                }
+            }
+        }
+    }
+    static const FftPlan& get(size_t n) {
+        return cached_plan<FftPlan>(n);
+    }
+private:
+    size_t n;
+    std::vector<Complex> twiddles;
+};
+
+// Forward FFT of n real samples (n being a power of two, at least 2).
+// The input is packed as n/2 complex values, transformed with a half-size
+// FftPlan and then split into the n/2 + 1 non-redundant bins of the real
+// spectrum, which halves the work and the memory of a complex transform.
+struct RealFftPlan {
+    explicit RealFftPlan(size_t n) : n(n), half(FftPlan::get(n / 2)),
+            twiddles(n / 4 + 1) {
+        if (n < 2 || (n & (n - 1)))
+            throw std::invalid_argument("FFT size has to be a power of two");
+        for (size_t k = 0; k < twiddles.size(); ++k) {
+            double phase = -2.0 * M_PI * double(k) / double(n);
+            twiddles[k] = Complex(float(cos(phase)), float(sin(phase)));
+        }
+    }
+    size_t size() const { return this->n; }
+    // `out` has to have room for size()/2 + 1 bins
+    void transform(const float *in, Complex *out) const {
+        const size_t h = n / 2;
+        for (size_t k = 0; k < h; ++k) {
+            out[k] = Complex(in[2 * k], in[2 * k + 1]);
+        }
+        half.transform(out);
+        // split the packed spectrum: bins k and h - k are computed together
+        // as X[h - k] = conj(E - W^k * O)
+        const Complex z0 = out[0];
+        out[0] = Complex(z0.real() + z0.imag(), 0.0f);
+        out[h] = Complex(z0.real() - z0.imag(), 0.0f);
+        for (size_t k = 1; k <= h / 2; ++k) {
+            const Complex zk = out[k];
+            const Complex zm = std::conj(out[h - k]);
+            const Complex even = 0.5f * (zk + zm);
+            const Complex diff = zk - zm;
+            const Complex odd = Complex(0.5f * diff.imag(), -0.5f * diff.real());
+            const Complex t = cmul(twiddles[k], odd);
+            out[k] = even + t;
+            out[h - k] = std::conj(even - t);
+        }
+    }
+    static const RealFftPlan& get(size_t n) {
+        return cached_plan<RealFftPlan>(n);
+    }
+private:
+    size_t n;
+    const FftPlan &half;
+    std::vector<Complex> twiddles;
+};
+
+// Split interleaved frames into one float plane per channel. The loops
+// below have a constant stride so the compiler can vectorize them, the
+// common stereo 16-bit and float layouts also get hand-written SSE2/NEON
+// versions.
+template<unsigned channels, class sample_type>
+void deinterleave_fixed(const sample_type *in, size_t frames, float *const *out) {
+    for (size_t f = 0; f < frames; ++f) {
+        for (unsigned ch = 0; ch < channels; ++ch) {
+            out[ch][f] = float(in[f * channels + ch]);
+        }
+    }
+}
+
+// Returns the number of frames done, the caller finishes the rest
+template<class sample_type>
+size_t deinterleave_stereo_simd(const sample_type *, size_t, float *, float *) {
+    return 0;
+}
+
+#if defined(__SSE2__)
+template<>
+inline size_t deinterleave_stereo_simd<int16_t>(const int16_t *in, size_t frames,
+                                                float *left, float *right) {
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * f));
+        // sign-extend the low and the high half of every 32-bit frame
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        __m128i r = _mm_srai_epi32(v, 16);
+        _mm_storeu_ps(left + f, _mm_cvtepi32_ps(l));
+        _mm_storeu_ps(right + f, _mm_cvtepi32_ps(r));
+    }
+    return f;
+}
+template<>
+inline size_t deinterleave_stereo_simd<float>(const float *in, size_t frames,
+                                              float *left, float *right) {
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        __m128 a = _mm_loadu_ps(in + 2 * f);
+        __m128 b = _mm_loadu_ps(in + 2 * f + 4);
+        _mm_storeu_ps(left + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    return f;
+}
+#elif defined(__ARM_NEON)
+template<>
+inline size_t deinterleave_stereo_simd<int16_t>(const int16_t *in, size_t frames,
+                                                float *left, float *right) {
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        int16x4x2_t v = vld2_s16(in + 2 * f);
+        vst1q_f32(left + f, vcvtq_f32_s32(vmovl_s16(v.val[0])));
+        vst1q_f32(right + f, vcvtq_f32_s32(vmovl_s16(v.val[1])));
+    }
+    return f;
+}
+template<>
+inline size_t deinterleave_stereo_simd<float>(const float *in, size_t frames,
+                                              float *left, float *right) {
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        float32x4x2_t v = vld2q_f32(in + 2 * f);
+        vst1q_f32(left + f, v.val[0]);
+        vst1q_f32(right + f, v.val[1]);
+    }
+    return f;
+}
+#endif
+
+// `planes` gets resized to `channels` planes of `frames` samples each
+template<class sample_type>
+void deinterleave(const sample_type *in, size_t frames, unsigned channels,
+                  std::vector<std::vector<float>> &planes) {
+    planes.resize(channels);
+    std::vector<float*> out(channels);
+    for (unsigned ch = 0; ch < channels; ++ch) {
+        planes[ch].resize(frames);
+        out[ch] = &planes[ch][0];
+    }
+    switch (channels) {
+        case 1: deinterleave_fixed<1>(in, frames, &out[0]); break;
+        case 2: {
+            size_t done = deinterleave_stereo_simd(in, frames, out[0], out[1]);
+            float *rest[] = {out[0] + done, out[1] + done};
+            deinterleave_fixed<2>(in + 2 * done, frames - done, rest);
+            break;
+        }
+        case 4: deinterleave_fixed<4>(in, frames, &out[0]); break;
+        case 6: deinterleave_fixed<6>(in, frames, &out[0]); break;
+        case 8: deinterleave_fixed<8>(in, frames, &out[0]); break;
+        default:
+            for (size_t f = 0; f < frames; ++f)
+                for (unsigned ch = 0; ch < channels; ++ch)
+                    out[ch][f] = float(in[f * channels + ch]);
+    }
+}
+
+// Sine generator without any trigonometry per sample. Four phasors, one
+// sample apart, are rotated by four samples' worth of phase at a time so
+// the SIMD lanes stay independent. The phase itself is accumulated in
+// double precision and the phasors are rebuilt from it on every call,
+// which keeps the rounding errors of the rotation from building up.
+struct Oscillator {
+    Oscillator(float freq, float rate, float amplitude)
+        : step(double(freq) / double(rate)), amplitude(amplitude) {
+        const double rotation = 2.0 * M_PI * step * lanes;
+        rot_re = float(cos(rotation));
+        rot_im = float(sin(rotation));
+    }
+    // writes `count` samples of amplitude * sin(phase) to `out`
+    void generate(float *out, size_t count) {
+        alignas(16) float re[lanes], im[lanes];
+        for (size_t j = 0; j < lanes; ++j) {
+            const double lane_phase = 2.0 * M_PI * (phase + step * j);
+            re[j] = amplitude * float(cos(lane_phase));
+            im[j] = amplitude * float(sin(lane_phase));
+        }
+        const size_t vectorized = count - count % lanes;
+        size_t i = 0;
+#if defined(__SSE2__)
+        __m128 vre = _mm_load_ps(re), vim = _mm_load_ps(im);
+        const __m128 c = _mm_set1_ps(rot_re), s = _mm_set1_ps(rot_im);
+        for (; i < vectorized; i += lanes) {
+            _mm_storeu_ps(out + i, vim);
+            const __m128 next_re = _mm_sub_ps(_mm_mul_ps(vre, c), _mm_mul_ps(vim, s));
+            vim = _mm_add_ps(_mm_mul_ps(vre, s), _mm_mul_ps(vim, c));
+            vre = next_re;
+        }
+        _mm_store_ps(re, vre);
+        _mm_store_ps(im, vim);
+#elif defined(__ARM_NEON)
+        float32x4_t vre = vld1q_f32(re), vim = vld1q_f32(im);
+        for (; i < vectorized; i += lanes) {
+            vst1q_f32(out + i, vim);
+            const float32x4_t next_re = vmlsq_n_f32(vmulq_n_f32(vre, rot_re), vim, rot_im);
+            vim = vmlaq_n_f32(vmulq_n_f32(vim, rot_re), vre, rot_im);
+            vre = next_re;
+        }
+        vst1q_f32(re, vre);
+        vst1q_f32(im, vim);
+#else
+        for (; i < vectorized; i += lanes) {
+            for (size_t j = 0; j < lanes; ++j) {
+                out[i + j] = im[j];
+                const float next_re = re[j] * rot_re - im[j] * rot_im;
+                im[j] = re[j] * rot_im + im[j] * rot_re;
+                re[j] = next_re;
+            }
+        }
+#endif
+        for (size_t j = 0; i < count; ++i, ++j) {
+            out[i] = im[j];
+        }
+        phase += step * double(count);
+        phase -= std::floor(phase);
+    }
+private:
+    static const size_t lanes = 4;
+    double step;   // in cycles per sample
+    double phase = 0.0;  // in cycles
+    float amplitude;
+    float rot_re, rot_im;
+};
+
+// Converts samples in the [-1.0, 1.0] range to storage_type. Integer
+// formats are mapped around the middle of their range, so silence is 0 for
+// int16_t and 32768 for uint16_t.
+template<class storage_type, bool = std::is_floating_point<storage_type>::value>
+struct SampleConverter {
+    static storage_type convert(float x) {
+        return storage_type(x);
+    }
+};
+
+template<class storage_type>
+struct SampleConverter<storage_type, false> {
+    static storage_type convert(float x) {
+        const float lo = float(std::numeric_limits<storage_type>::min());
+        const float hi = float(std::numeric_limits<storage_type>::max());
+        const float mid = (lo + hi + 1.0f) / 2.0f;
+        x = std::min(std::max(x, -1.0f), 1.0f);
+        return storage_type(mid + x * (hi - mid));
+    }
+};
+
+// Converts a mono signal and copies it to all `channels` of `out`
+template<class storage_type>
+void interleave_mono(const float *in, size_t frames, unsigned channels,
+                     storage_type *out) {
+    for (size_t f = 0; f < frames; ++f) {
+        const storage_type sample = SampleConverter<storage_type>::convert(in[f]);
+        for (unsigned ch = 0; ch < channels; ++ch) {
+            out[f * channels + ch] = sample;
+        }
+    }
+}
+
+// Power of a single DFT bin, computed sample by sample
+struct Goertzel {
+    // `bin` out of `block_size` bins, i.e. bin * rate / block_size Hz
+    Goertzel(double bin, size_t block_size)
+        : coeff(2.0 * cos(2.0 * M_PI * bin / double(block_size))) {}
+    void feed(double x) {
+        double s = x + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s;
+    }
+    double power() const { return s1 * s1 + s2 * s2 - coeff * s1 * s2; }
+    void reset() { s1 = s2 = 0.0; }
+private:
+    double coeff;
+    double s1 = 0.0;
+    double s2 = 0.0;
+};
+
+// Streaming check whether `freq` is the dominant frequency of a signal.
+// Samples are analysed in blocks long enough for a DFT bin to be at most
+// `tolerance` Hz wide. Goertzel filters on the bins around `freq` tell where
+// the peak is, and the energy of the block tells whether the peak dominates
+// it: for a pure tone that lands on a bin, 2 * power / (block * energy) is 1.
+struct ToneDetector {
+    ToneDetector(float freq, float rate, float tolerance)
+            : freq(freq), tolerance(tolerance) {
+        // pick the block size so that `freq` falls on a bin
+        target_bin = std::max(1L, long(std::ceil(freq / tolerance)));
+        block = size_t(std::lround(double(rate) * target_bin / freq));
+        bin_width = rate / float(block);
+        for (long bin = target_bin - 2; bin <= target_bin + 2; ++bin) {
+            if (bin > 0) {
+                bins.push_back(bin);
+                filters.push_back(Goertzel(double(bin), block));
+            }
+        }
+    }
+    // Returns true as soon as a block where `freq` dominates was seen
+    template<class sample_type>
+    bool feed(const sample_type *samples, size_t count, size_t stride = 1) {
+        for (size_t i = 0; i < count; i += stride) {
+            const double x = samples[i];
+            sum += x;
+            sum_sq += x * x;
+            for (auto &filter: filters) filter.feed(x);
+            if (++fed == block && finish_block()) return true;
+        }
+        return false;
+    }
+    // Peak frequency of the last complete block, 0 if nothing dominated it
+    float dominant() const { return last_dominant; }
+    float block_duration(float rate) const { return float(block) / rate; }
+private:
+    bool finish_block() {
+        // energy around the mean, so a DC offset doesn't count
+        const double energy = sum_sq - sum * sum / double(block);
+        size_t best = 0;
+        for (size_t i = 1; i < filters.size(); ++i) {
+            if (filters[i].power() > filters[best].power()) best = i;
+        }
+        const double ratio = energy > 0.0 ?
+            2.0 * filters[best].power() / (double(block) * energy) : 0.0;
+        last_dominant = ratio >= 0.5 ? float(bins[best]) * bin_width : 0.0f;
+        for (auto &filter: filters) filter.reset();
+        fed = 0;
+        sum = sum_sq = 0.0;
+        return last_dominant > 0.0f &&
+            std::abs(last_dominant - freq) <= tolerance;
+    }
+    float freq;
+    float tolerance;
+    long target_bin;
+    size_t block;
+    float bin_width;
+    std::vector<long> bins;
+    std::vector<Goertzel> filters;
+    size_t fed = 0;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    float last_dominant = 0.0f;
+};
+
+// Linear sweep from f0 to f1 Hz, faded in and out with a Hann window so it
+// doesn't click. Its autocorrelation is one narrow peak, which makes it easy
+// to find again in a noisy recording.
+inline std::vector<float> chirp(float f0, float f1, size_t frames, float rate,
+                                float amplitude) {
+    std::vector<float> result(frames);
+    const double length = double(frames) / rate;
+    for (size_t i = 0; i < frames; ++i) {
+        const double t = double(i) / rate;
+        const double phase = 2.0 * M_PI * (f0 * t + (f1 - f0) * t * t / (2.0 * length));
+        const double window = 0.5 - 0.5 * cos(2.0 * M_PI * double(i) / double(frames - 1));
+        result[i] = float(amplitude * window * sin(phase));
+    }
+    return result;
+}
+
+// Offset at which `probe` shows up in `signal`: the lag with the highest
+// cross-correlation, computed with FFTs. `score` gets the correlation
+// coefficient at that lag, 1 for a (scaled) copy of the probe.
+inline size_t find_probe(const std::vector<float> &signal,
+                         const std::vector<float> &probe, float *score) {
+    *score = 0.0f;
+    if (probe.empty() || signal.size() < probe.size()) return 0;
+    // padded so that the circular correlation doesn't wrap around
+    const size_t n = next_pow2(signal.size() + probe.size());
+    const FftPlan &plan = FftPlan::get(n);
+    std::vector<Complex> a(n), b(n);
+    std::copy(signal.begin(), signal.end(), a.begin());
+    std::copy(probe.begin(), probe.end(), b.begin());
+    plan.transform(&a[0]);
+    plan.transform(&b[0]);
+    // the inverse transform is the forward one of the conjugate, conjugated
+    // again; the correlation is real, so the second conjugate is skipped
+    for (size_t k = 0; k < n; ++k) {
+        a[k] = std::conj(cmul(a[k], std::conj(b[k])));
     }
+    plan.transform(&a[0]);
+    size_t best = 0;
+    for (size_t lag = 1; lag + probe.size() <= signal.size(); ++lag) {
+        if (a[lag].real() > a[best].real()) best = lag;
+    }
+    double probe_energy = 0.0;
+    double window_energy = 0.0;
+    for (size_t i = 0; i < probe.size(); ++i) {
+        probe_energy += double(probe[i]) * probe[i];
+        window_energy += double(signal[best + i]) * signal[best + i];
+    }
+    if (probe_energy > 0.0 && window_energy > 0.0) {
+        *score = float(a[best].real() / double(n) /
+                       sqrt(probe_energy * window_energy));
+    }
+    return best;
 }
+}; //namespace Dsp
 
 struct Logger {
     enum class Level {normal, info, debug};
@@ -63,6 +526,102 @@ private:
 
 Logger logger = Logger();
 
+struct Options {
+    // analyse the capture while recording instead of FFT-ing all of it
+    bool streaming = false;
+    // channels played and recorded, each one is analysed separately
+    unsigned channels = 2;
+    // transfer samples through the mmapped ring buffer of the devices
+    bool mmap = false;
+    // device pairs the fallback loopback may try at the same time, or
+    // recordings analysed at the same time
+    unsigned jobs = 1;
+    // playback writes the tone to this file instead of playing it
+    std::string output;
+    // the (non-streaming) loopback also saves what it recorded here
+    std::string save_capture;
+};
+
+Options options;
+
+// A fixed number of preallocated period buffers, handed from one producer
+// thread to one consumer thread without locking. The producer never waits:
+// when every slot is taken the period is dropped and counted instead, so an
+// analysis that falls behind can't make the capture device overrun.
+template<class sample_type>
+struct PeriodRing {
+    PeriodRing(size_t slots, size_t period_samples)
+        : slots(slots, Slot{std::vector<sample_type>(period_samples), 0}) {}
+
+    // producer side, false if the period had to be dropped
+    bool push(const sample_type *samples, size_t count) {
+        const size_t head = this->head.load(std::memory_order_relaxed);
+        const size_t fill = head - this->tail.load(std::memory_order_acquire);
+        if (fill == this->slots.size()) {
+            this->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        this->peak = std::max(this->peak.load(std::memory_order_relaxed), fill + 1);
+        auto &slot = this->slots[head % this->slots.size()];
+        slot.count = std::min(count, slot.samples.size());
+        std::copy(samples, samples + slot.count, slot.samples.begin());
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    // producer side, no more periods will be pushed
+    void close() {
+        this->closed.store(true, std::memory_order_release);
+    }
+    // consumer side, calls fn(samples, count) with the oldest period and
+    // releases its slot afterwards. False if there was nothing to consume.
+    template<class Fn>
+    bool pop(Fn fn) {
+        const size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail == this->head.load(std::memory_order_acquire)) return false;
+        auto &slot = this->slots[tail % this->slots.size()];
+        fn(&slot.samples[0], slot.count);
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    // consumer side, closed and everything pushed has been consumed
+    bool finished() const {
+        return this->closed.load(std::memory_order_acquire) &&
+            this->tail.load(std::memory_order_relaxed) ==
+            this->head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return this->slots.size(); }
+    size_t overflows() const { return this->dropped.load(); }
+    size_t peak_fill() const { return this->peak.load(); }
+
+private:
+    struct Slot {
+        std::vector<sample_type> samples;
+        size_t count;
+    };
+    std::vector<Slot> slots;
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+    std::atomic<size_t> dropped{0};
+    std::atomic<size_t> peak{0};
+};
+
+// Periods the capture thread can get ahead of the analysis
+const size_t capture_ring_periods = 32;
+
+// SCHED_FIFO keeps the ALSA wakeups on time when the machine is busy. It
+// needs CAP_SYS_NICE (or an rtprio limit), without it the thread just runs
+// with the normal priority.
+void set_realtime_priority(std::thread &thread) {
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+    int err = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param);
+    if (err) {
+        logger.info() << "Couldn't make the capture thread real-time: "
+            << strerror(err) << std::endl;
+    }
+}
+
 std::vector<std::pair<std::string, std::string>> all_formats = {
     {"float_44100", "Float32 encoded, 44100Hz sampling"},
     {"float_48000", "Float32 encoded, 48000Hz sampling"},
@@ -80,12 +639,20 @@ struct AlsaError: std::runtime_error {
     explicit AlsaError(const string& what_arg) : runtime_error(what_arg) {}
 };
 
+// rw copies every period through snd_pcm_writei/readi, mmap reads and
+// writes the samples directly in the ring buffer of the device
+enum class Access {rw, mmap};
+
+inline Access requested_access() {
+    return options.mmap ? Access::mmap : Access::rw;
+}
+
 template<class storage_type>
 struct Pcm {
     enum class Mode {playback, capture};
 
     Pcm() : Pcm{"default", Mode::playback} {}
-    Pcm(string device_name, Mode mode = Mode::playback) {
+    Pcm(string device_name, Mode mode = Mode::playback) : mode(mode) {
         snd_pcm_stream_t stream_mode;
         switch(mode) {
             case Mode::playback:
@@ -125,17 +692,27 @@ struct Pcm {
     void drain() {
         snd_pcm_drain(this->pcm_handle);
     }
-    void set_params(const unsigned desired_rate) {
+    void set_params(const unsigned desired_rate, const unsigned desired_channels = 2,
+                    const Access desired_access = Access::rw) {
         snd_pcm_hw_params_t *params = nullptr;
         snd_pcm_hw_params_alloca(&params);
         snd_pcm_hw_params_any(this->pcm_handle, params);
-        if (snd_pcm_hw_params_set_access(this->pcm_handle, params,
-            SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
+        this->access = desired_access;
+        if (this->access == Access::mmap && snd_pcm_hw_params_set_access(
+            this->pcm_handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+            logger.info() << "mmap access not supported, falling back to "
+                "read/write access" << std::endl;
+            this->access = Access::rw;
+        }
+        if (this->access == Access::rw && snd_pcm_hw_params_set_access(
+            this->pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
             throw AlsaError("Failed to set access mode");
         }
-        if (snd_pcm_hw_params_set_channels(this->pcm_handle, params, 2) < 0) {
+        if (snd_pcm_hw_params_set_channels(this->pcm_handle, params,
+            desired_channels) < 0) {
             throw AlsaError("Failed to set the number of channels");
         }
+        this->channels = desired_channels;
         if (auto res = snd_pcm_hw_params_set_format(this->pcm_handle, params,
             get_alsa_format()) < 0) {
             throw AlsaError(string("Failed to set format") + string(
@@ -166,98 +743,243 @@ struct Pcm {
         snd_pcm_hw_params_get_channels_max(params, &channs);
         logger.info() << "no. of channels: " << channs << std::endl;
     }
-    void sine(const float freq, const float duration, const float amplitude) const {
-        auto *buff = new storage_type[this->period * 2];
-        void *ugly_ptr = static_cast<void*>(buff);
+    void sine(const float freq, const float duration, const float amplitude,
+              const std::atomic<bool> *stop = nullptr) const {
+        // the volume scales the wave around silence, not around the lowest
+        // value of storage_type
+        const float volume = std::min(std::max(amplitude, 0.0f), 1.0f);
+        Dsp::Oscillator oscillator(freq, float(this->rate), volume);
+        std::vector<float> wave(this->period);
+        // only needed when the samples can't go straight to the device
+        std::vector<storage_type> buff(
+            this->access == Access::rw ? this->period * this->channels : 0);
         unsigned t = 0;
         while (t < float(this->rate) * duration) {
-            for (int i=0; i < this->period * 2; i+=2) {
-                auto sample = sin(2 * M_PI *((t + i/2) / (this->rate / freq)));
-                // we need to convert the sample to the target range, -1.0f should
-                // match the min_val and +1.0f should match the max_val
-                auto target_range = float(this->max_val()) - float(this->min_val());
-                sample = target_range * ((sample + 1.0f)/2.0f) + float(min_val());
-                // saturate/trim
-                if (sample > float(max_val()))
-                    sample = max_val();
-                else if (sample < float(min_val()))
-                    sample = min_val();
-                // set volume
-                sample *= amplitude;
-                buff[i] = sample;
-                buff[i+1] = buff[i]; // the other channel
-            }
-            auto res = snd_pcm_writei(this->pcm_handle, ugly_ptr, this->period);
-            if (res == -EPIPE) {
-                logger.info() << "Buffer underrun" << std::endl;
-                snd_pcm_prepare(this->pcm_handle);
+            if (stop && *stop) {
+                logger.info() << "Playback stopped early" << std::endl;
+                break;
+            }
+            oscillator.generate(&wave[0], this->period);
+            if (this->access == Access::mmap) {
+                snd_pcm_uframes_t done = 0;
+                while (done < this->period) {
+                    auto res = mmap_transfer(this->period - done,
+                        [&](storage_type *area, snd_pcm_uframes_t frames) {
+                            Dsp::interleave_mono(&wave[done], frames, this->channels, area);
+                        });
+                    // mmap_transfer() already tried to recover, the
+                    // device is gone: every other period would only wait
+                    // out the timeout
+                    if (res < 0) {
+                        throw AlsaError(std::string("Playback failed: ") +
+                                        snd_strerror(int(res)));
+                    }
+                    done += res;
+                }
+            } else {
+                Dsp::interleave_mono(&wave[0], this->period, this->channels, &buff[0]);
+                auto res = snd_pcm_writei(this->pcm_handle,
+                    static_cast<void*>(&buff[0]), this->period);
+                if (res < 0 && recover(res) < 0) {
+                    throw AlsaError(std::string("Playback failed: ") +
+                                    snd_strerror(int(res)));
+                }
             }
             t += this->period;
         }
         logger.info() << "state: " <<
             snd_pcm_state_name(snd_pcm_state(this->pcm_handle)) << std::endl;
         snd_pcm_start(this->pcm_handle);
-        delete[] buff;
     }
-    void record(storage_type *buff, int buff_size /*in samples*/) {
-        auto *local_buff = new storage_type[this->period * 2];
+    unsigned get_channels() const { return this->channels; }
+    unsigned get_rate() const { return this->rate; }
+    snd_pcm_uframes_t get_period() const { return this->period; }
+    // what set_params() settled on, it falls back from mmap to rw
+    Access get_access() const { return this->access; }
+    // underruns (playback) or overruns (capture) seen so far
+    unsigned get_xruns() const { return this->xruns; }
+    // Frames between the application and the other end of the device: for
+    // playback the ones not played yet, for capture the ones not read yet.
+    // Negative on error.
+    snd_pcm_sframes_t delay() const {
+        snd_pcm_sframes_t frames = 0;
+        int res = snd_pcm_delay(this->pcm_handle, &frames);
+        return res < 0 ? res : frames;
+    }
+    void record(storage_type *buff, int buff_size /*in samples*/,
+                const std::atomic<bool> *stop = nullptr) {
+        const snd_pcm_uframes_t period_samples = this->period * this->channels;
         int res;
         snd_pcm_start(this->pcm_handle);
         logger.info() << "state: " <<
             snd_pcm_state_name(snd_pcm_state(this->pcm_handle)) << std::endl;
 
-        while(buff_size > 0) {
-            if (buff_size >= this->period * 2) {
-                void *ugly_ptr = static_cast<void*>(buff);
-                res = snd_pcm_readi(this->pcm_handle, ugly_ptr, this->period);
-                buff_size -= this->period * 2;
-                buff += this->period *2;
-            } else {
-                void *ugly_ptr = static_cast<void*>(local_buff);
-                res = snd_pcm_readi(this->pcm_handle, ugly_ptr, this->period);
-                std::memcpy(buff, local_buff, buff_size * sizeof(storage_type));
-                buff_size = 0;
+        if (this->access == Access::mmap) {
+            snd_pcm_uframes_t frames_left = buff_size / this->channels;
+            while (frames_left > 0 && !(stop && *stop)) {
+                auto res = mmap_transfer(std::min(frames_left, this->period),
+                    [&](const storage_type *area, snd_pcm_uframes_t frames) {
+                        std::memcpy(buff, area,
+                            frames * this->channels * sizeof(storage_type));
+                    });
+                if (res < 0) break;
+                frames_left -= res;
+                buff += res * this->channels;
+            }
+            return;
+        }
+        auto *local_buff = new storage_type[period_samples];
+        while(buff_size > 0 && !(stop && *stop)) {
+            // the last, partial period goes through local_buff
+            const bool whole = buff_size >= int(period_samples);
+            void *ugly_ptr = static_cast<void*>(whole ? buff : local_buff);
+            res = snd_pcm_readi(this->pcm_handle, ugly_ptr, this->period);
+            if (res < 0) {
+                // unplugged or otherwise gone, as in play()
+                if (recover(res) < 0) break;
+                continue;
             }
+            int got = std::min(int(res * this->channels), buff_size);
+            if (!whole) {
+                std::memcpy(buff, local_buff, got * sizeof(storage_type));
+            }
+            buff_size -= got;
+            buff += got;
         }
         delete[] local_buff;
     }
-    void play(storage_type *buff, int buff_size) {
+    // Capture up to `max_frames` frames, handing each period to `consumer`
+    // as it arrives, until the consumer returns false
+    void record(std::function<bool(const storage_type*, snd_pcm_uframes_t)> consumer,
+                snd_pcm_uframes_t max_frames) {
+        snd_pcm_start(this->pcm_handle);
+        logger.info() << "state: " <<
+            snd_pcm_state_name(snd_pcm_state(this->pcm_handle)) << std::endl;
+        if (this->access == Access::mmap) {
+            // the consumer reads the samples where the device put them
+            bool more = true;
+            while (more && max_frames > 0) {
+                auto res = mmap_transfer(std::min(max_frames, this->period),
+                    [&](const storage_type *area, snd_pcm_uframes_t frames) {
+                        more = consumer(area, frames);
+                    });
+                if (res < 0) break;
+                max_frames -= res;
+            }
+            return;
+        }
+        std::vector<storage_type> local_buff(this->period * this->channels);
+        while (max_frames > 0) {
+            auto res = snd_pcm_readi(this->pcm_handle,
+                static_cast<void*>(&local_buff[0]), this->period);
+            if (res < 0) {
+                if (recover(res) < 0) break;
+                continue;
+            }
+            auto frames = std::min(snd_pcm_uframes_t(res), max_frames);
+            max_frames -= frames;
+            if (!consumer(&local_buff[0], frames)) break;
+        }
+    }
+    void play(storage_type *buff, int buff_size /*in samples*/) {
         snd_pcm_prepare(this->pcm_handle);
-        while (buff_size > 0) {
+        while (this->access == Access::mmap && buff_size > 0) {
+            auto res = mmap_transfer(
+                std::min(snd_pcm_uframes_t(buff_size) / this->channels, this->period),
+                [&](storage_type *area, snd_pcm_uframes_t frames) {
+                    std::memcpy(area, buff, frames * this->channels * sizeof(storage_type));
+                });
+            if (res <= 0) break;
+            buff_size -= res * this->channels;
+            buff += res * this->channels;
+        }
+        while (this->access == Access::rw && buff_size > 0) {
             void *ugly_ptr = static_cast<void*>(buff);
-            auto res = snd_pcm_writei(this->pcm_handle, ugly_ptr, this->period);
-            buff_size -= this->period *2;
-            buff += this->period * 2;
+            auto frames = std::min(snd_pcm_uframes_t(buff_size) / this->channels,
+                                   this->period);
+            if (frames == 0) break;
+            auto res = snd_pcm_writei(this->pcm_handle, ugly_ptr, frames);
+            if (res < 0) {
+                if (recover(res) < 0) break;
+                continue;
+            }
+            buff_size -= res * this->channels;
+            buff += res * this->channels;
         }
         logger.info() << "state: " <<
             snd_pcm_state_name(snd_pcm_state(this->pcm_handle)) << std::endl;
     }
 
+    static snd_pcm_format_t get_alsa_format();
 
 private:
-    snd_pcm_format_t get_alsa_format();
-    bool is_little_endian() {
+    // Waits until `frames` frames can be transferred and hands the matching
+    // part of the mmapped ring buffer to `fn`, as interleaved samples. The ring
+    // may wrap before `frames`, fn() is told how many frames it actually got
+    // and the same count is returned (or a negative error code).
+    template<class Fn>
+    snd_pcm_sframes_t mmap_transfer(snd_pcm_uframes_t frames, Fn fn) const {
+        for (;;) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(this->pcm_handle);
+            if (avail < 0) {
+                int res = recover(int(avail));
+                if (res < 0) return res;
+                if (mode == Mode::capture) snd_pcm_start(this->pcm_handle);
+                continue;
+            }
+            if (snd_pcm_uframes_t(avail) >= frames) break;
+            if (mode == Mode::playback &&
+                snd_pcm_state(this->pcm_handle) == SND_PCM_STATE_PREPARED) {
+                // the ring buffer is full, so it's time to start playing
+                snd_pcm_start(this->pcm_handle);
+            }
+            int res = snd_pcm_wait(this->pcm_handle, 1000);
+            if (res == 0) return -EIO; // nothing happened within a second
+            if (res < 0) {
+                res = snd_pcm_recover(this->pcm_handle, res, 1);
+                if (res < 0) return res;
+            }
+        }
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        int res = snd_pcm_mmap_begin(this->pcm_handle, &areas, &offset, &frames);
+        if (res < 0) return res;
+        // interleaved access: all channels share the first area
+        auto *area = reinterpret_cast<storage_type*>(
+            static_cast<char*>(areas[0].addr) + areas[0].first / 8
+            + offset * (areas[0].step / 8));
+        fn(area, frames);
+        return snd_pcm_mmap_commit(this->pcm_handle, offset, frames);
+    }
+    // Counts and logs an xrun (or other transfer error) and tries to get the
+    // device going again
+    int recover(int err) const {
+        if (err == -EPIPE) {
+            ++this->xruns;
+            logger.info() << (mode == Mode::playback ? "Buffer underrun" :
+                "Buffer overrun") << std::endl;
+        } else {
+            logger.info() << "Transfer error: " << snd_strerror(err) << std::endl;
+        }
+        return snd_pcm_recover(this->pcm_handle, err, 1 /* silent */);
+    }
+    static bool is_little_endian() {
         #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
             return true;
         #else
             return false;
         #endif
     }
-    storage_type min_val() const { return std::numeric_limits<storage_type>::min();}
-    storage_type max_val() const { return std::numeric_limits<storage_type>::max();}
 
     snd_pcm_t *pcm_handle;
     unsigned rate;
     snd_pcm_uframes_t period;
+    unsigned channels;
     Mode mode;
+    Access access = Access::rw;
+    mutable unsigned xruns = 0;
 };
 
-template<>
-float Alsa::Pcm<float>::min_val() const { return -1.0f; }
-
-template<>
-float Alsa::Pcm<float>::max_val() const { return 1.0f; }
-
 template<>
 snd_pcm_format_t Alsa::Pcm<float>::get_alsa_format() {
     return is_little_endian() ? SND_PCM_FORMAT_FLOAT_LE : SND_PCM_FORMAT_FLOAT_BE;
@@ -323,74 +1045,648 @@ private:
     snd_mixer_elem_t* elem;
 };
 
-std::vector<std::string> get_devices(std::string io) {
-    std::vector<std::string> result;
-    void **out;
-    int err = snd_device_name_hint(-1 /* all cards */, "pcm", &out);
+// Name of the card a device lives on, e.g. "PCH" for "hw:CARD=PCH,DEV=0" or
+// "1" for "plughw:1,0". Empty for devices like "default" or "pulse".
+std::string card_of(const std::string &device) {
+    auto start = device.find("CARD=");
+    if (start != std::string::npos) {
+        start += 5;
+    } else if ((start = device.find(':')) != std::string::npos) {
+        start += 1;
+    } else {
+        return "";
+    }
+    return device.substr(start, device.find(',', start) - start);
+}
+
+// What a device accepts in one direction, as reported by
+// snd_pcm_hw_params_test_format() and the min/max getters
+struct Capabilities {
+    bool available = false; // the PCM could be opened at all
+    std::vector<snd_pcm_format_t> formats;
+    unsigned rate_min = 0;
+    unsigned rate_max = 0;
+    unsigned channels_min = 0;
+    unsigned channels_max = 0;
+    bool supports(snd_pcm_format_t format, unsigned rate, unsigned channels) const {
+        return available &&
+            std::find(formats.begin(), formats.end(), format) != formats.end() &&
+            rate >= rate_min && rate <= rate_max &&
+            channels >= channels_min && channels <= channels_max;
+    }
+};
+
+struct DeviceInfo {
+    string name;
+    string card;
+    string ioid; // "Input", "Output" or "Both", as in the IOID hint
+    Capabilities playback;
+    Capabilities capture;
+    bool can_play() const { return ioid != "Input"; }
+    bool can_record() const { return ioid != "Output"; }
+};
+
+// Opens the device without blocking (so a busy device doesn't stall the
+// scan) and checks the formats alsa_test knows about
+Capabilities probe_device(const string &name, snd_pcm_stream_t stream) {
+    Capabilities caps;
+    snd_pcm_t *handle;
+    if (snd_pcm_open(&handle, name.c_str(), stream, SND_PCM_NONBLOCK) < 0) {
+        return caps;
+    }
+    snd_pcm_hw_params_t *params = nullptr;
+    snd_pcm_hw_params_alloca(&params);
+    if (snd_pcm_hw_params_any(handle, params) >= 0) {
+        caps.available = true;
+        for (auto format: {Pcm<float>::get_alsa_format(),
+                           Pcm<int16_t>::get_alsa_format(),
+                           Pcm<uint16_t>::get_alsa_format()}) {
+            if (snd_pcm_hw_params_test_format(handle, params, format) == 0) {
+                caps.formats.push_back(format);
+            }
+        }
+        int dir;
+        snd_pcm_hw_params_get_rate_min(params, &caps.rate_min, &dir);
+        snd_pcm_hw_params_get_rate_max(params, &caps.rate_max, &dir);
+        snd_pcm_hw_params_get_channels_min(params, &caps.channels_min);
+        snd_pcm_hw_params_get_channels_max(params, &caps.channels_max);
+    }
+    snd_pcm_close(handle);
+    return caps;
+}
+
+// All PCM devices from a single snd_device_name_hint() scan. With
+// `probe_devices` every device is also opened in the directions it
+// supports, to find out what it accepts.
+std::vector<DeviceInfo> get_device_index(bool probe_devices = false) {
+    std::vector<DeviceInfo> result;
+    void **hints;
+    int err = snd_device_name_hint(-1 /* all cards */, "pcm", &hints);
     if (err) {
         logger.normal() << "Couldn't get the device hints" << std::endl;
         return result;
     }
-    while (*out) {
-        const char *name = snd_device_name_get_hint(*out, "NAME");
-        const char *desc = snd_device_name_get_hint(*out, "DESC");
-        const char *ioid = snd_device_name_get_hint(*out, "IOID");
-        if (ioid == nullptr) ioid = "Both";
-        logger.info() << "Got a device hint. Name: " << name
-                      << " Description: " << desc
-                      << " IOID: " << ioid << std::endl;
-        std::string direction{ioid};
-        if (direction == io) {
-           result.push_back(std::string{name});
+    // the hint strings are malloc'ed copies, so they have to be freed too
+    auto get_hint = [](void *hint, const char *id) {
+        char *value = snd_device_name_get_hint(hint, id);
+        string result = value ? string(value) : string();
+        free(value);
+        return result;
+    };
+    for (void **hint = hints; *hint; ++hint) {
+        DeviceInfo device;
+        device.name = get_hint(*hint, "NAME");
+        device.ioid = get_hint(*hint, "IOID");
+        if (device.ioid.empty()) device.ioid = "Both";
+        device.card = card_of(device.name);
+        logger.info() << "Got a device hint. Name: " << device.name
+                      << " Description: " << get_hint(*hint, "DESC")
+                      << " IOID: " << device.ioid << std::endl;
+        if (device.name.empty()) continue;
+        if (probe_devices && device.can_play()) {
+            device.playback = probe_device(device.name, SND_PCM_STREAM_PLAYBACK);
         }
-        out++;
+        if (probe_devices && device.can_record()) {
+            device.capture = probe_device(device.name, SND_PCM_STREAM_CAPTURE);
+        }
+        result.push_back(device);
+    }
+    snd_device_name_free_hint(hints);
+    return result;
+}
+
+// Devices usable for playback (or recording), the ones dedicated to that
+// direction first and then the ones that do both
+std::vector<const DeviceInfo*> devices_for(const std::vector<DeviceInfo> &index,
+                                           snd_pcm_stream_t stream) {
+    const bool playback = stream == SND_PCM_STREAM_PLAYBACK;
+    std::vector<const DeviceInfo*> result;
+    for (auto &device: index) {
+        if (device.ioid == (playback ? "Output" : "Input")) result.push_back(&device);
+    }
+    for (auto &device: index) {
+        if (device.ioid == "Both") result.push_back(&device);
     }
     return result;
 }
 }; //namespace Alsa
 
+// Recordings on disk instead of a device: WAV files (PCM or IEEE float) and
+// headerless raw files, interleaved like the device buffers. Both directions
+// go through a mapping of the whole file, the analysis reads the samples
+// straight from the page cache.
+namespace File{
+
+using std::string;
+
+struct FileError: std::runtime_error {
+    explicit FileError(const string& what_arg) : runtime_error(what_arg) {}
+};
+
+inline string errno_message(const string &what, const string &path) {
+    return what + " " + path + ": " + strerror(errno);
+}
+
+// A whole file mapped in memory: read-only for an existing file, or
+// read-write for a new one of `size` bytes. The new file gets its blocks
+// up front, a full filesystem is an error here rather than a SIGBUS on
+// the first store into a hole of the mapping.
+struct MappedFile {
+    explicit MappedFile(const string &path) {
+        this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (this->fd < 0) throw FileError(errno_message("Failed to open", path));
+        struct stat st;
+        if (fstat(this->fd, &st) < 0) fail("Failed to stat", path);
+        this->length = size_t(st.st_size);
+        map(PROT_READ, MAP_PRIVATE, path);
+        // the analysis goes from the start to the end, once
+        if (this->bytes) madvise(this->bytes, this->length, MADV_SEQUENTIAL);
+    }
+    MappedFile(const string &path, size_t size) : length(size) {
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (this->fd < 0) throw FileError(errno_message("Failed to create", path));
+        if (size) {
+            // returns the error instead of setting errno
+            int err = posix_fallocate(this->fd, 0, off_t(size));
+            if (err) {
+                errno = err;
+                fail("Failed to allocate", path);
+            }
+        }
+        map(PROT_READ | PROT_WRITE, MAP_SHARED, path);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (this->bytes) munmap(this->bytes, this->length);
+        close(this->fd);
+    }
+    const char *data() const { return this->bytes; }
+    char *data() { return this->bytes; }
+    size_t size() const { return this->length; }
+private:
+    void map(int prot, int flags, const string &path) {
+        if (this->length == 0) return; // nothing to map, and mmap() refuses
+        void *addr = mmap(nullptr, this->length, prot, flags, this->fd, 0);
+        if (addr == MAP_FAILED) fail("Failed to map", path);
+        this->bytes = static_cast<char*>(addr);
+    }
+    [[noreturn]] void fail(const string &what, const string &path) {
+        auto msg = errno_message(what, path);
+        close(this->fd);
+        throw FileError(msg);
+    }
+    int fd = -1;
+    size_t length = 0;
+    char *bytes = nullptr;
+};
+
+// How the samples of a recording are laid out
+struct Format {
+    snd_pcm_format_t format;
+    unsigned rate;
+    unsigned channels;
+};
+
+inline size_t sample_size(snd_pcm_format_t format) {
+    switch (format) {
+        case SND_PCM_FORMAT_S8: case SND_PCM_FORMAT_U8:
+            return 1;
+        case SND_PCM_FORMAT_S16_LE: case SND_PCM_FORMAT_S16_BE:
+        case SND_PCM_FORMAT_U16_LE: case SND_PCM_FORMAT_U16_BE:
+            return 2;
+        case SND_PCM_FORMAT_FLOAT_LE: case SND_PCM_FORMAT_FLOAT_BE:
+            return 4;
+        case SND_PCM_FORMAT_FLOAT64_LE: case SND_PCM_FORMAT_FLOAT64_BE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+// WAV format tags, WAVE_FORMAT_EXTENSIBLE keeps the real one in its
+// subformat GUID
+const uint16_t wave_pcm = 1;
+const uint16_t wave_float = 3;
+const uint16_t wave_extensible = 0xfffe;
+const size_t wav_header_size = 44;
+
+inline uint16_t get_le16(const char *p) {
+    return uint16_t(uint8_t(p[0]) | uint8_t(p[1]) << 8);
+}
+inline uint32_t get_le32(const char *p) {
+    return uint32_t(get_le16(p)) | uint32_t(get_le16(p + 2)) << 16;
+}
+inline void put_le16(char *p, uint16_t value) {
+    p[0] = char(value);
+    p[1] = char(value >> 8);
+}
+inline void put_le32(char *p, uint32_t value) {
+    put_le16(p, uint16_t(value));
+    put_le16(p + 2, uint16_t(value >> 16));
+}
+
+// The sample layout described by a "fmt " chunk. Only the layouts alsa_test
+// records in are accepted, WAV itself has no signed 8 or unsigned 16 bit PCM.
+inline Format wav_format(const char *fmt, uint32_t size, const string &path) {
+    uint16_t tag = get_le16(fmt);
+    const unsigned channels = get_le16(fmt + 2);
+    const unsigned rate = get_le32(fmt + 4);
+    const unsigned bits = get_le16(fmt + 14);
+    if (tag == wave_extensible && size >= 40) tag = get_le16(fmt + 24);
+    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+    if (tag == wave_pcm && bits == 8) format = SND_PCM_FORMAT_U8;
+    else if (tag == wave_pcm && bits == 16) format = SND_PCM_FORMAT_S16_LE;
+    else if (tag == wave_float && bits == 32) format = SND_PCM_FORMAT_FLOAT_LE;
+    else if (tag == wave_float && bits == 64) format = SND_PCM_FORMAT_FLOAT64_LE;
+    if (format == SND_PCM_FORMAT_UNKNOWN || !channels || !rate) {
+        throw FileError(path + ": unsupported WAV format (tag " + std::to_string(tag)
+            + ", " + std::to_string(bits) + " bits)");
+    }
+    return Format{format, rate, channels};
+}
+
+// A mapped recording. WAV files describe themselves, anything else is taken
+// as raw samples in `raw_format`.
+struct Recording {
+    Format format;
+    const char *samples = nullptr;
+    size_t frames = 0;
+    std::unique_ptr<MappedFile> file;
+};
+
+inline Recording open_recording(const string &path, const Format &raw_format) {
+    Recording rec;
+    rec.file.reset(new MappedFile(path));
+    rec.format = raw_format;
+    const char *data = rec.file->data();
+    const size_t size = rec.file->size();
+    size_t offset = 0;
+    size_t length = size;
+    if (size >= 12 && !memcmp(data, "RIFF", 4) && !memcmp(data + 8, "WAVE", 4)) {
+        bool have_format = false, have_data = false;
+        size_t pos = 12;
+        while (!have_data && pos + 8 <= size) {
+            const char *chunk = data + pos;
+            const size_t chunk_size = get_le32(chunk + 4);
+            pos += 8;
+            if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16 && pos + chunk_size <= size) {
+                rec.format = wav_format(chunk + 8, uint32_t(chunk_size), path);
+                have_format = true;
+            } else if (!memcmp(chunk, "data", 4)) {
+                // a recorder that didn't get to finish the header leaves 0
+                // or a size past the end, the samples are what's there
+                offset = pos;
+                length = size - pos;
+                if (chunk_size > 0 && chunk_size < length) length = chunk_size;
+                have_data = true;
+            }
+            pos += chunk_size + (chunk_size & 1); // chunks are 16-bit aligned
+        }
+        if (!have_format || !have_data) {
+            throw FileError(path + ": no format or no data in the WAV file");
+        }
+    }
+    const size_t frame_size = sample_size(rec.format.format) * rec.format.channels;
+    if (!frame_size) throw FileError(path + ": unsupported sample format");
+    rec.samples = data + offset;
+    rec.frames = length / frame_size;
+    return rec;
+}
+
+inline bool is_wav_name(const string &path) {
+    return path.size() >= 4 && strcasecmp(path.c_str() + path.size() - 4, ".wav") == 0;
+}
+
+// Removes the file at `path` when it goes out of scope, unless kept
+struct TempFile {
+    explicit TempFile(const string &path) : path(path) {}
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+    ~TempFile() {
+        if (!this->kept) unlink(this->path.c_str());
+    }
+    void keep() { this->kept = true; }
+    const string path;
+private:
+    bool kept = false;
+};
+
+// Writes interleaved samples as a WAV file if `path` ends with .wav, as raw
+// samples otherwise. The file is written under a temporary name and renamed
+// once complete, so whoever reads it never gets half of it, and the
+// temporary one is gone whatever fails on the way.
+template<class storage_type>
+void write_recording(const string &path, const storage_type *samples,
+                     size_t frames, unsigned channels, unsigned rate) {
+    static std::atomic<unsigned> writes{0};
+    const snd_pcm_format_t format = Alsa::Pcm<storage_type>::get_alsa_format();
+    const size_t length = frames * channels * sizeof(storage_type);
+    const bool wav = is_wav_name(path);
+    uint16_t tag = 0;
+    switch (format) {
+        case SND_PCM_FORMAT_U8: case SND_PCM_FORMAT_S16_LE:
+            tag = wave_pcm;
+            break;
+        case SND_PCM_FORMAT_FLOAT_LE: case SND_PCM_FORMAT_FLOAT64_LE:
+            tag = wave_float;
+            break;
+        default:
+            break;
+    }
+    if (wav && !tag) {
+        throw FileError(path + ": WAV can't hold these samples, use a raw file");
+    }
+    if (wav && length > UINT32_MAX - wav_header_size) {
+        throw FileError(path + ": too long for a WAV file, use a raw file");
+    }
+    const size_t header = wav ? wav_header_size : 0;
+    TempFile temp(path + ".part" + std::to_string(getpid()) + "."
+                  + std::to_string(writes++));
+    {
+        MappedFile out(temp.path, header + length);
+        char *p = out.data();
+        if (wav) {
+            const unsigned block = channels * sizeof(storage_type);
+            memcpy(p, "RIFF", 4);
+            put_le32(p + 4, uint32_t(header + length - 8));
+            memcpy(p + 8, "WAVEfmt ", 8);
+            put_le32(p + 16, 16);
+            put_le16(p + 20, tag);
+            put_le16(p + 22, uint16_t(channels));
+            put_le32(p + 24, rate);
+            put_le32(p + 28, rate * block);
+            put_le16(p + 32, uint16_t(block));
+            put_le16(p + 34, uint16_t(8 * sizeof(storage_type)));
+            memcpy(p + 36, "data", 4);
+            put_le32(p + 40, uint32_t(length));
+        }
+        if (length) memcpy(p + header, samples, length);
+    }
+    if (rename(temp.path.c_str(), path.c_str()) < 0) {
+        throw FileError(errno_message("Failed to rename " + temp.path + " to", path));
+    }
+    temp.keep();
+}
+
+}; //namespace File
+
+// The tone the playback test plays, written to a file for later analysis
+template<class storage_type>
+void write_tone(const std::string &path, float freq, float duration,
+                int sampling_rate, float amplitude) {
+    const unsigned channels = options.channels;
+    const size_t frames = size_t(ceil(float(sampling_rate) * duration));
+    Dsp::Oscillator oscillator(freq, float(sampling_rate), amplitude);
+    std::vector<float> wave(frames);
+    std::vector<storage_type> buff(frames * channels);
+    oscillator.generate(&wave[0], frames);
+    Dsp::interleave_mono(&wave[0], frames, channels, &buff[0]);
+    File::write_recording(path, &buff[0], frames, channels, unsigned(sampling_rate));
+}
+
 template<class storage_type>
 int playback_test(float duration, int sampling_rate, const char* capture_pcm, const char* playback_pcm) {
-    auto player = Alsa::Pcm<storage_type>();
-    player.set_params(sampling_rate);
-    player.sine(440, duration, 0.5f);
+    if (!options.output.empty()) {
+        try {
+            write_tone<storage_type>(options.output, 440, duration, sampling_rate, 0.5f);
+        } catch (const File::FileError &err) {
+            logger.normal() << err.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    try {
+        auto player = Alsa::Pcm<storage_type>();
+        player.set_params(sampling_rate, options.channels, Alsa::requested_access());
+        player.sine(440, duration, 0.5f);
+    }
+    catch (const Alsa::AlsaError &exc) {
+        logger.normal() << "Alsa problem: " << exc.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
 
 template<class storage_type>
-float dominant_freq(storage_type *buff, int buffsize, int rate) {
-    CArray data(buffsize);
+float dominant_freq(const storage_type *buff, int buffsize, int rate) {
+    if (buffsize < 2) return 0.0f;
+    // The radix-2 plan only deals with powers of two, so the recording is
+    // zero-padded up to the next one. Padding only interpolates the
+    // spectrum, the bin width is then rate / fft_size instead of
+    // rate / buffsize. The DC offset is removed first, otherwise padding an
+    // unsigned recording smears its offset over the low frequency bins.
+    const size_t fft_size = Dsp::next_pow2(buffsize);
+    double mean = 0.0;
     for (int i=0; i < buffsize; i++) {
-        data[i] = std::complex<float>(buff[i], 0);
+        mean += buff[i];
     }
-    fft(data);
-    auto freqs = std::vector<float>(buffsize/2); // drop mirrored freqs
-    for (int i=0; i< buffsize / 2; i++){
-        freqs[i] = std::abs(data[i]);
+    mean /= buffsize;
+    std::vector<float> samples(fft_size, 0.0f);
+    for (int i=0; i < buffsize; i++) {
+        samples[i] = float(buff[i] - mean);
     }
-    auto it = std::max_element(freqs.begin(), freqs.end());
-    if (it != freqs.end()) {
-        return float(std::distance(freqs.begin(), it)) / (float(buffsize) / rate);
-    } else {
-        return 0.0f;
+    std::vector<Dsp::Complex> spectrum(fft_size / 2 + 1);
+    Dsp::RealFftPlan::get(fft_size).transform(&samples[0], &spectrum[0]);
+    size_t dominant = 0;
+    float dominant_power = 0.0f;
+    for (size_t i=1; i < spectrum.size(); i++){ // skip DC
+        float power = std::norm(spectrum[i]);
+        if (power > dominant_power) {
+            dominant_power = power;
+            dominant = i;
+        }
     }
+    return float(dominant) / (float(fft_size) / rate);
 }
+// Logs what every channel picked up, returns true if all of them heard
+// `test_freq`
+bool check_channels(const std::vector<float> &dominant, float test_freq, float epsilon,
+                    std::ostream &out = logger.normal()) {
+    bool all_passed = true;
+    for (size_t ch = 0; ch < dominant.size(); ++ch) {
+        std::string prefix = dominant.size() > 1 ?
+            "Channel " + std::to_string(ch) + ": " : "";
+        if (dominant[ch] <= 0.0f) {
+            out << prefix << "No dominant frequency" << std::endl;
+            all_passed = false;
+            continue;
+        }
+        out << prefix << "Dominant frequency: " << dominant[ch] << std::endl;
+        float deviation = std::abs(test_freq - dominant[ch]);
+        out << prefix << "Deviation: " << deviation << std::endl;
+        if (deviation > epsilon)
+            all_passed = false;
+    }
+    return all_passed;
+}
+// Dominant frequency of every channel of an interleaved recording. The
+// channels are deinterleaved into `planes` and FFT-ed at the same time,
+// unless `parallel` is false.
 template<class storage_type>
-int loopback_test(float duration, int sampling_rate, const char* capture_pcm, const char* playback_pcm) {
+std::vector<float> channel_frequencies(const storage_type *buff, size_t frames,
+                                       unsigned channels, int sampling_rate,
+                                       std::vector<std::vector<float>> &planes,
+                                       bool parallel = true) {
+    // every channel gets its own spectrum, a mixed one would hide a dead
+    // channel and needlessly double the size of the FFT
+    Dsp::deinterleave(buff, frames, channels, planes);
+    std::vector<float> dominant;
+    if (!parallel) {
+        for (auto &plane: planes) {
+            dominant.push_back(dominant_freq<float>(&plane[0], plane.size(), sampling_rate));
+        }
+        return dominant;
+    }
+    std::vector<std::future<float>> results;
+    for (auto &plane: planes) {
+        results.push_back(std::async(std::launch::async, [&plane, sampling_rate]() {
+            return dominant_freq<float>(&plane[0], plane.size(), sampling_rate);
+        }));
+    }
+    for (auto &result: results) {
+        dominant.push_back(result.get());
+    }
+    return dominant;
+}
+// What streaming_loopback_test() finds, for a recording that is already in
+// memory: `passed` is set if every channel had a block dominated by
+// `test_freq`, the analysis stops there
+template<class storage_type>
+std::vector<float> detect_tone(const storage_type *buff, size_t frames,
+                               unsigned channels, int sampling_rate,
+                               float test_freq, float epsilon, bool &passed) {
+    const size_t chunk = 4096; // frames fed to the detectors at a time
+    std::vector<Dsp::ToneDetector> detectors(
+        channels, Dsp::ToneDetector(test_freq, sampling_rate, epsilon));
+    std::vector<bool> channel_passed(channels, false);
+    passed = false;
+    for (size_t f = 0; f < frames && !passed; f += chunk) {
+        const size_t count = std::min(chunk, frames - f) * channels;
+        passed = true;
+        for (unsigned ch = 0; ch < channels; ++ch) {
+            if (!channel_passed[ch]) {
+                channel_passed[ch] = detectors[ch].feed(
+                    buff + f * channels + ch, count, channels);
+            }
+            passed = passed && channel_passed[ch];
+        }
+    }
+    std::vector<float> dominant;
+    for (auto &detector: detectors) {
+        dominant.push_back(detector.dominant());
+    }
+    return dominant;
+}
+template<class storage_type>
+int streaming_loopback_test(float duration, int sampling_rate, const char* capture_pcm,
+                            const char* playback_pcm, const std::atomic<bool> *cancel,
+                            std::ostream &out) {
     const float test_freq = 440.0f;
-    int buffsize = static_cast<int>(ceil(float(sampling_rate * 2) * duration));
+    float epsilon = 5 / duration + 1;
+    const unsigned channels = options.channels;
+    auto frames = snd_pcm_uframes_t(ceil(float(sampling_rate) * duration));
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        if (cancel && *cancel) return 1;
+        std::vector<Dsp::ToneDetector> detectors(
+            channels, Dsp::ToneDetector(test_freq, sampling_rate, epsilon));
+        std::vector<bool> channel_passed(channels, false);
+        std::atomic<bool> passed{false};
+        std::atomic<bool> stop{false};
+        unsigned periods = 0;
+        auto recorder = Alsa::Pcm<storage_type> (capture_pcm, Alsa::Pcm<storage_type>::Mode::capture);
+        recorder.set_params(sampling_rate, channels, Alsa::requested_access());
+        // the capture thread only copies periods into the ring, so it always
+        // gets back to the device in time, however long the analysis takes
+        PeriodRing<storage_type> ring(capture_ring_periods,
+                                      recorder.get_period() * channels);
+        std::thread rec_thread([&]() {
+            recorder.record([&](const storage_type *samples, snd_pcm_uframes_t count) {
+                ring.push(samples, count * channels);
+                return !stop && !(cancel && *cancel);
+            }, frames);
+            ring.close();
+        });
+        set_realtime_priority(rec_thread);
+        const auto idle = std::chrono::microseconds(
+            1000000 * recorder.get_period() / sampling_rate / 4);
+        std::thread analysis_thread([&]() {
+            while (!ring.finished()) {
+                bool got = ring.pop([&](const storage_type *samples, size_t count) {
+                    if (stop) return;
+                    periods++;
+                    bool all_passed = true;
+                    for (unsigned ch = 0; ch < channels; ++ch) {
+                        if (!channel_passed[ch]) {
+                            channel_passed[ch] = detectors[ch].feed(
+                                samples + ch, count, channels);
+                        }
+                        all_passed = all_passed && channel_passed[ch];
+                    }
+                    if (all_passed) passed = true;
+                    if (passed || (cancel && *cancel)) stop = true;
+                });
+                if (!got) std::this_thread::sleep_for(idle);
+            }
+        });
+        try {
+            auto player = Alsa::Pcm<storage_type>(playback_pcm);
+            player.set_params(sampling_rate, channels, Alsa::requested_access());
+            player.sine(test_freq, duration, 0.5f, &stop);
+            if (!stop) player.drain();
+            rec_thread.join();
+            analysis_thread.join();
+        }
+        catch (Alsa::AlsaError& exc) {
+            stop = true;
+            rec_thread.join();
+            analysis_thread.join();
+            return 1;
+        }
+        if (ring.overflows()) {
+            out << "Analysis fell behind the capture, "
+                << ring.overflows() << " periods dropped" << std::endl;
+        }
+        logger.info() << "Peak capture ring fill: " << ring.peak_fill() << "/"
+            << ring.capacity() << " periods" << std::endl;
+        logger.info() << "Analysed " << periods << " periods" << std::endl;
+        std::vector<float> dominant;
+        for (auto &detector: detectors) {
+            dominant.push_back(detector.dominant());
+        }
+        if (check_channels(dominant, test_freq, epsilon, out) && passed)
+            return 0;
+    }
+    return 1;
+}
+// Gives up (and fails) as soon as `cancel` gets set. What the channels
+// picked up is written to `out`
+template<class storage_type>
+int run_loopback(float duration, int sampling_rate, const char* capture_pcm,
+                 const char* playback_pcm, const std::atomic<bool> *cancel,
+                 std::ostream &out) {
+    if (options.streaming) {
+        return streaming_loopback_test<storage_type>(
+            duration, sampling_rate, capture_pcm, playback_pcm, cancel, out);
+    }
+    const float test_freq = 440.0f;
+    const unsigned channels = options.channels;
+    const int frames = static_cast<int>(ceil(float(sampling_rate) * duration));
+    int buffsize = frames * channels;
     std::vector<storage_type> buff(buffsize);
+    std::vector<std::vector<float>> planes;
     for (int attempt = 0; attempt < 3; ++attempt) {
+        if (cancel && *cancel) return 1;
         for (int i=0; i<buffsize; i++) buff[i] = storage_type(0);
         auto recorder = Alsa::Pcm<storage_type> (capture_pcm, Alsa::Pcm<storage_type>::Mode::capture);
-        recorder.set_params(sampling_rate);
-        std::thread rec_thread([&recorder, &buff, &buffsize]() mutable{
-            recorder.record(&buff[0], buffsize);
+        recorder.set_params(sampling_rate, channels, Alsa::requested_access());
+        std::thread rec_thread([&recorder, &buff, &buffsize, cancel]() mutable{
+            recorder.record(&buff[0], buffsize, cancel);
         });
         try {
             auto player = Alsa::Pcm<storage_type>(playback_pcm);
-            player.set_params(sampling_rate);
-            player.sine(test_freq, duration, 0.5f);
+            player.set_params(sampling_rate, channels, Alsa::requested_access());
+            player.sine(test_freq, duration, 0.5f, cancel);
             player.drain();
             rec_thread.join();
         }
@@ -398,47 +1694,365 @@ int loopback_test(float duration, int sampling_rate, const char* capture_pcm, co
             rec_thread.join();
             return 1;
         }
-        float dominant = dominant_freq<storage_type>(&buff[0], buffsize, sampling_rate * 2);
-        if (dominant > 0.0f) {
-            //buff contains stereo samples, so the sampling rate can be considered 88200
-            logger.normal() << "Dominant frequency: " << dominant << std::endl;
-            // inverse-proportional to duration - the longer it runs,
-            // the more accurate the fft gets
-            float epsilon = 5 / duration + 1;
-            float deviation = abs(test_freq - dominant);
-            logger.normal() << "Deviation: " << deviation << std::endl;
-            if (deviation <= epsilon)
-                return 0;
+        if (cancel && *cancel) return 1;
+        if (!options.save_capture.empty()) {
+            try {
+                File::write_recording(options.save_capture, &buff[0], frames,
+                                      channels, unsigned(sampling_rate));
+            } catch (const File::FileError &err) {
+                out << "Failed to save the capture: " << err.what() << std::endl;
+            }
         }
+        auto dominant = channel_frequencies(&buff[0], frames, channels,
+                                            sampling_rate, planes);
+        // inverse-proportional to duration - the longer it runs,
+        // the more accurate the fft gets
+        float epsilon = 5 / duration + 1;
+        if (check_channels(dominant, test_freq, epsilon, out))
+            return 0;
     }
     return 1;
 }
+// Round trip latency of the playback -> capture loop and what the devices
+// went through while it was measured. A chirp is played at a known capture
+// position and found again in the recording by cross-correlation; capture
+// periods are timed on the way. Results are printed as "key: value" lines.
 template<class storage_type>
-int fallback_loopback(float duration, int sampling_rate, const char* _1, const char* _2) {
-    auto playback = Alsa::get_devices("Output");
-    auto record = Alsa::get_devices("Input");
-    auto both = Alsa::get_devices("Both");
-    std::copy(both.begin(), both.end(), std::back_inserter(playback));
-    std::copy(both.begin(), both.end(), std::back_inserter(record));
-    for (auto player = playback.cbegin(); player != playback.cend(); ++player) {
-        if (*player == std::string{"surround40:CARD=PCH,DEV=0"}) {
-            continue;
+int latency_test(float duration, int sampling_rate, const char* capture_pcm, const char* playback_pcm) {
+    typedef std::chrono::steady_clock clock;
+    const unsigned channels = options.channels;
+    const float rate = float(sampling_rate);
+    const auto probe = Dsp::chirp(500.0f, 5000.0f, size_t(rate / 10), rate, 0.5f);
+    // the chirp is played first, the rest of `duration` is silence that
+    // leaves room for the latency
+    const size_t play_frames = std::max(size_t(rate * duration), 2 * probe.size());
+    const size_t capture_frames = play_frames + size_t(rate / 4);
+
+    auto recorder = Alsa::Pcm<storage_type>(capture_pcm, Alsa::Pcm<storage_type>::Mode::capture);
+    recorder.set_params(sampling_rate, channels, Alsa::requested_access());
+    std::vector<float> captured;
+    captured.reserve(capture_frames);
+    std::mutex position_mutex;
+    // capture position (frames read plus frames waiting in the device) and
+    // when it was taken, to tell where the playback starts in the recording
+    snd_pcm_sframes_t position = 0;
+    clock::time_point position_time;
+    std::atomic<bool> running{false};
+    std::atomic<bool> stop{false};
+    snd_pcm_sframes_t max_capture_delay = 0;
+    // wakeup time minus the duration of the period that woke us up
+    double jitter_sum = 0.0;
+    double jitter_max = 0.0;
+    size_t wakeups = 0;
+    std::thread rec_thread([&]() {
+        size_t read_frames = 0;
+        clock::time_point last;
+        recorder.record([&](const storage_type *samples, snd_pcm_uframes_t count) {
+            const auto now = clock::now();
+            if (read_frames > 0) {
+                const double expected = 1e6 * double(count) / rate;
+                const double jitter = std::abs(
+                    std::chrono::duration<double, std::micro>(now - last).count() - expected);
+                jitter_sum += jitter;
+                jitter_max = std::max(jitter_max, jitter);
+                ++wakeups;
+            }
+            last = now;
+            for (snd_pcm_uframes_t i = 0; i < count; ++i) {
+                captured.push_back(float(samples[i * channels]));
+            }
+            read_frames += count;
+            const auto delay = std::max(recorder.delay(), snd_pcm_sframes_t(0));
+            max_capture_delay = std::max(max_capture_delay, delay);
+            {
+                std::lock_guard<std::mutex> lock(position_mutex);
+                position = snd_pcm_sframes_t(read_frames) + delay;
+                position_time = now;
+            }
+            running = true;
+            return !stop;
+        }, capture_frames);
+        running = true;
+    });
+    set_realtime_priority(rec_thread);
+    while (!running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    snd_pcm_sframes_t start_position;
+    snd_pcm_sframes_t playback_delay;
+    unsigned playback_xruns;
+    try {
+        auto player = Alsa::Pcm<storage_type>(playback_pcm);
+        player.set_params(sampling_rate, channels, Alsa::requested_access());
+        std::vector<float> wave(play_frames, 0.0f);
+        std::copy(probe.begin(), probe.end(), wave.begin());
+        std::vector<storage_type> buff(play_frames * channels);
+        Dsp::interleave_mono(&wave[0], play_frames, channels, &buff[0]);
+        {
+            std::lock_guard<std::mutex> lock(position_mutex);
+            const double since = std::chrono::duration<double>(
+                clock::now() - position_time).count();
+            start_position = position + snd_pcm_sframes_t(since * rate);
         }
-        for (auto recorder = record.cbegin(); recorder != record.cend(); ++recorder) {
-            logger.normal() << "Trying combination " << *player << " -> " << *recorder << std::endl;
+        player.play(&buff[0], buff.size());
+        // whatever is still queued once everything was written
+        playback_delay = player.delay();
+        player.drain();
+        playback_xruns = player.get_xruns();
+        rec_thread.join();
+    }
+    catch (Alsa::AlsaError& exc) {
+        logger.normal() << "Alsa problem: " << exc.what() << std::endl;
+        stop = true;
+        rec_thread.join();
+        return 1;
+    }
+
+    double mean = 0.0;
+    for (auto sample: captured) mean += sample;
+    mean /= std::max(captured.size(), size_t(1));
+    for (auto &sample: captured) sample -= float(mean);
+    float score;
+    const auto lag = snd_pcm_sframes_t(Dsp::find_probe(captured, probe, &score));
+    const auto latency = lag - start_position;
+
+    // a coefficient that low means the recording is mostly something else
+    const bool found = score >= 0.5f;
+    if (found) {
+        logger.normal() << "latency_frames: " << latency << std::endl;
+        logger.normal() << "latency_ms: " << 1000.0 * latency / rate << std::endl;
+    }
+    logger.normal() << "correlation: " << score << std::endl;
+    logger.normal() << "capture_period_frames: " << recorder.get_period() << std::endl;
+    logger.normal() << "period_jitter_mean_us: "
+        << (wakeups ? jitter_sum / wakeups : 0.0) << std::endl;
+    logger.normal() << "period_jitter_max_us: " << jitter_max << std::endl;
+    logger.normal() << "playback_delay_frames: " << playback_delay << std::endl;
+    logger.normal() << "capture_delay_max_frames: " << max_capture_delay << std::endl;
+    logger.normal() << "playback_xruns: " << playback_xruns << std::endl;
+    logger.normal() << "capture_xruns: " << recorder.get_xruns() << std::endl;
+    if (!found) {
+        logger.normal() << "Chirp not found in the capture" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+template<class storage_type>
+int loopback_test(float duration, int sampling_rate, const char* capture_pcm, const char* playback_pcm) {
+    return run_loopback<storage_type>(
+        duration, sampling_rate, capture_pcm, playback_pcm, nullptr, logger.normal());
+}
+// Tries every player -> recorder pair, up to `jobs` of them at a time, and
+// stops all of them as soon as one passes. Pairs run concurrently only if
+// they don't share a card, two tests fighting over the same hw device would
+// just make each other fail. Devices with no known card (like "default")
+// could be routed to any card, so they only run when nothing else does.
+// Every pair's report is printed in one piece once it is done, so the
+// ones running side by side don't get mixed up.
+template<class storage_type>
+int sweep_pairs(float duration, int sampling_rate,
+                const std::vector<std::pair<std::string, std::string>> &pairs,
+                unsigned jobs) {
+    std::mutex mutex;
+    std::condition_variable card_freed;
+    std::vector<bool> started(pairs.size(), false);
+    size_t pending = pairs.size();
+    std::multiset<std::string> busy_cards;
+    std::atomic<bool> passed{false};
+
+    auto cards_of = [&pairs](size_t i) {
+        return std::vector<std::string>{
+            Alsa::card_of(pairs[i].first), Alsa::card_of(pairs[i].second)};
+    };
+    auto can_start = [&](size_t i) {
+        if (busy_cards.count("")) return false;
+        for (auto &card: cards_of(i)) {
+            if (card.empty() ? !busy_cards.empty() : busy_cards.count(card) > 0)
+                return false;
+        }
+        return true;
+    };
+    auto worker = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!passed && pending > 0) {
+            size_t next = 0;
+            while (next < pairs.size() && (started[next] || !can_start(next)))
+                ++next;
+            if (next == pairs.size()) {
+                card_freed.wait(lock);
+                continue;
+            }
+            started[next] = true;
+            --pending;
+            auto cards = cards_of(next);
+            busy_cards.insert(cards.begin(), cards.end());
+            lock.unlock();
+
+            const auto &player = pairs[next].first;
+            const auto &recorder = pairs[next].second;
+            std::ostringstream report;
+            report << "Trying combination " << player << " -> " << recorder << std::endl;
             try {
-                int error = loopback_test<storage_type>(
-                    duration, sampling_rate, recorder->c_str(), player->c_str());
-                if (!error) {
-                    return 0;
+                int error = run_loopback<storage_type>(duration, sampling_rate,
+                    recorder.c_str(), player.c_str(), &passed, report);
+                if (!error && !passed.exchange(true)) {
+                    report << "Combination " << player << " -> " << recorder << " passed" << std::endl;
                 }
             }
             catch(Alsa::AlsaError& exc) {
-                logger.normal() << "Alsa problem: " << exc.what() << std::endl;
+                report << "Alsa problem: " << exc.what() << std::endl;
             }
+
+            lock.lock();
+            logger.normal() << report.str() << std::flush;
+            for (auto &card: cards) {
+                busy_cards.erase(busy_cards.find(card));
+            }
+            card_freed.notify_all();
         }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < std::max(jobs, 1u); ++i) {
+        workers.push_back(std::thread(worker));
     }
-    return 1;
+    worker();
+    for (auto &thread: workers) {
+        thread.join();
+    }
+    return passed ? 0 : 1;
+}
+template<class storage_type>
+int fallback_loopback(float duration, int sampling_rate, const char* _1, const char* _2) {
+    auto index = Alsa::get_device_index(true /* probe */);
+    const auto format = Alsa::Pcm<storage_type>::get_alsa_format();
+    // drop the devices that wouldn't even accept the parameters of the test,
+    // trying them would only cost an open and a failed set_params() per pair
+    auto usable = [&](snd_pcm_stream_t stream) {
+        const bool playback = stream == SND_PCM_STREAM_PLAYBACK;
+        std::vector<std::string> result;
+        for (auto device: Alsa::devices_for(index, stream)) {
+            const auto &caps = playback ? device->playback : device->capture;
+            if (!caps.supports(format, sampling_rate, options.channels)) {
+                logger.info() << "Skipping " << device->name << " for "
+                    << (playback ? "playback" : "recording") << ": "
+                    << (caps.available ? "parameters not supported" : "cannot be opened")
+                    << std::endl;
+                continue;
+            }
+            result.push_back(device->name);
+        }
+        return result;
+    };
+    auto playback = usable(SND_PCM_STREAM_PLAYBACK);
+    auto record = usable(SND_PCM_STREAM_CAPTURE);
+    std::vector<std::pair<std::string, std::string>> pairs;
+    for (auto player = playback.cbegin(); player != playback.cend(); ++player) {
+        for (auto recorder = record.cbegin(); recorder != record.cend(); ++recorder) {
+            pairs.push_back(std::make_pair(*player, *recorder));
+        }
+    }
+    logger.info() << "Trying " << pairs.size() << " device combinations" << std::endl;
+    return sweep_pairs<storage_type>(duration, sampling_rate, pairs, options.jobs);
+}
+// The loopback analysis of a recording made earlier, with the same test
+// frequency and tolerance as the live test of the same duration
+template<class storage_type>
+bool analyse_recording(const File::Recording &rec, std::ostream &out) {
+    const float test_freq = 440.0f;
+    const unsigned channels = rec.format.channels;
+    const int sampling_rate = int(rec.format.rate);
+    if (rec.frames < 2) {
+        out << "Recording too short" << std::endl;
+        return false;
+    }
+    const float duration = float(rec.frames) / sampling_rate;
+    const float epsilon = 5 / duration + 1;
+    // a WAV data chunk doesn't have to be aligned for storage_type
+    std::vector<storage_type> copy;
+    auto samples = reinterpret_cast<const storage_type*>(rec.samples);
+    if (reinterpret_cast<uintptr_t>(rec.samples) % alignof(storage_type)) {
+        copy.resize(rec.frames * channels);
+        std::memcpy(&copy[0], rec.samples, copy.size() * sizeof(storage_type));
+        samples = &copy[0];
+    }
+    if (options.streaming) {
+        bool passed;
+        auto dominant = detect_tone(samples, rec.frames, channels, sampling_rate,
+                                    test_freq, epsilon, passed);
+        return check_channels(dominant, test_freq, epsilon, out) && passed;
+    }
+    // the files are analysed in parallel already, not their channels
+    std::vector<std::vector<float>> planes;
+    auto dominant = channel_frequencies(samples, rec.frames, channels,
+                                        sampling_rate, planes, false);
+    return check_channels(dominant, test_freq, epsilon, out);
+}
+// Maps `path` and analyses it with the storage_type its samples are in.
+// `bytes` gets the size of the samples.
+bool analyse_file(const std::string &path, const File::Format &raw_format,
+                  std::ostream &out, size_t &bytes) {
+    auto rec = File::open_recording(path, raw_format);
+    const auto format = rec.format.format;
+    bytes = rec.frames * rec.format.channels * File::sample_size(format);
+    out << "Rate: " << rec.format.rate << ", channels: " << rec.format.channels
+        << ", frames: " << rec.frames << std::endl;
+    if (format == Alsa::Pcm<float>::get_alsa_format())
+        return analyse_recording<float>(rec, out);
+    if (format == Alsa::Pcm<double>::get_alsa_format())
+        return analyse_recording<double>(rec, out);
+    if (format == Alsa::Pcm<int16_t>::get_alsa_format())
+        return analyse_recording<int16_t>(rec, out);
+    if (format == Alsa::Pcm<uint16_t>::get_alsa_format())
+        return analyse_recording<uint16_t>(rec, out);
+    if (format == Alsa::Pcm<int8_t>::get_alsa_format())
+        return analyse_recording<int8_t>(rec, out);
+    if (format == Alsa::Pcm<uint8_t>::get_alsa_format())
+        return analyse_recording<uint8_t>(rec, out);
+    throw File::FileError(path + ": samples not in the byte order of this machine");
+}
+// Runs the loopback analysis over recordings instead of devices, `jobs`
+// files at a time. Every file gets a PASS or FAIL line, followed by what
+// each channel picked up.
+int analyse_files(const std::vector<std::string> &paths,
+                  const File::Format &raw_format, unsigned jobs) {
+    std::mutex mutex;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<unsigned long long> total_bytes{0};
+    const auto start = std::chrono::steady_clock::now();
+    auto worker = [&]() {
+        for (size_t i = next++; i < paths.size(); i = next++) {
+            std::ostringstream report;
+            bool passed = false;
+            size_t bytes = 0;
+            try {
+                passed = analyse_file(paths[i], raw_format, report, bytes);
+            } catch (const File::FileError &err) {
+                report << err.what() << std::endl;
+            }
+            if (!passed) ++failed;
+            total_bytes += bytes;
+            std::lock_guard<std::mutex> lock(mutex);
+            logger.normal() << paths[i] << ": " << (passed ? "PASS" : "FAIL")
+                << std::endl << report.str();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < std::min(std::max(jobs, 1u), unsigned(paths.size())); ++i) {
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto &thread: workers) {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    logger.info() << "Analysed " << total_bytes / 1048576.0 << " MiB in "
+        << seconds << " s (" << total_bytes / 1048576.0 / seconds << " MiB/s)"
+        << std::endl;
+    logger.normal() << paths.size() - failed << "/" << paths.size()
+        << " recordings passed" << std::endl;
+    return failed ? 1 : 0;
 }
 int list_formats(){
     const char* env_var = std::getenv("ALSA_TEST_FORMATS");
@@ -469,18 +2083,14 @@ int list_formats(){
 }
 
 int list_devices() {
-    auto playback = Alsa::get_devices("Output");
-    auto record = Alsa::get_devices("Input");
-    auto both = Alsa::get_devices("Both");
-    std::copy(both.begin(), both.end(), std::back_inserter(playback));
-    std::copy(both.begin(), both.end(), std::back_inserter(record));
+    auto index = Alsa::get_device_index();
     std::cout << "Playback devices: " << std::endl;
-    for (auto i = playback.cbegin(); i != playback.cend(); ++i) {
-        std::cout << *i << std::endl;
+    for (auto device: Alsa::devices_for(index, SND_PCM_STREAM_PLAYBACK)) {
+        std::cout << device->name << std::endl;
     }
     std::cout << "\n\nRecording devices: " << std::endl;
-    for (auto i = record.cbegin(); i != record.cend(); ++i) {
-        std::cout << *i << std::endl;
+    for (auto device: Alsa::devices_for(index, SND_PCM_STREAM_CAPTURE)) {
+        std::cout << device->name << std::endl;
     }
     return 0;
 }
@@ -499,6 +2109,24 @@ void set_volumes(const std::string playback_pcm, const std::string capture_pcm)
     }
 }
 
+// bench_alsa.cpp includes this file to get at the code above
+#ifndef ALSA_TEST_NO_MAIN
+// The arguments after the scenario that aren't options or their values
+std::vector<std::string> operands(const std::vector<std::string> &args) {
+    static const std::set<std::string> with_value = {
+        "-d", "--jobs", "--channels", "--format", "--capture-pcm",
+        "--playback-pcm", "--output", "--save-capture"};
+    std::vector<std::string> result;
+    for (size_t i = 2; i < args.size(); ++i) {
+        if (with_value.count(args[i])) {
+            ++i;
+        } else if (args[i].empty() || args[i][0] != '-') {
+            result.push_back(args[i]);
+        }
+    }
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     std::vector<std::string> args{};
     for (int i=0; i < argc; ++i) {
@@ -507,6 +2135,35 @@ int main(int argc, char *argv[]) {
     if (std::find(args.begin(), args.end(), std::string("-v")) != args.end()) {
         logger.set_level(Logger::Level::info);
     }
+    if (std::find(args.begin(), args.end(), std::string("--streaming")) != args.end()) {
+        options.streaming = true;
+    }
+    if (std::find(args.begin(), args.end(), std::string("--mmap")) != args.end()) {
+        options.mmap = true;
+    }
+    auto jobs_it = std::find(args.begin(), args.end(), std::string("--jobs"));
+    const bool jobs_given = jobs_it != args.end();
+    if (jobs_it != args.end()) { // not doing && because of sequence points
+        if (++jobs_it != args.end()) {
+            int jobs = atoi(jobs_it->c_str());
+            if (jobs < 1) {
+                std::cerr << "Invalid number of jobs: " << *jobs_it << std::endl;
+                return 1;
+            }
+            options.jobs = unsigned(jobs);
+        }
+    }
+    auto channels_it = std::find(args.begin(), args.end(), std::string("--channels"));
+    if (channels_it != args.end()) { // not doing && because of sequence points
+        if (++channels_it != args.end()) {
+            int channels = atoi(channels_it->c_str());
+            if (channels < 1) {
+                std::cerr << "Invalid number of channels: " << *channels_it << std::endl;
+                return 1;
+            }
+            options.channels = unsigned(channels);
+        }
+    }
     auto format = std::string("int16_48000");
     auto format_it = std::find(args.begin(), args.end(), std::string("--format"));
     if (format_it != args.end()) { // not doing && because of sequence points
@@ -527,20 +2184,28 @@ int main(int argc, char *argv[]) {
     logger.info() << "Using format: " << sample_format <<
                        " and sampling rate: " << sampling_rate << std::endl;
     std::map<std::string, int(*)(float, int, const char*, const char*)> scenarios;
+    // what raw recordings are taken to hold
+    File::Format raw_format{SND_PCM_FORMAT_UNKNOWN, unsigned(sampling_rate), options.channels};
     if (sample_format == "float") {
+        raw_format.format = Alsa::Pcm<float>::get_alsa_format();
         scenarios["playback"] = playback_test<float>;
         scenarios["loopback"] = loopback_test<float>;
         scenarios["fallback"] = fallback_loopback<float>;
+        scenarios["latency"] = latency_test<float>;
     }
     else if (sample_format == "int16") {
+        raw_format.format = Alsa::Pcm<int16_t>::get_alsa_format();
         scenarios["playback"] = playback_test<int16_t>;
         scenarios["loopback"] = loopback_test<int16_t>;
         scenarios["fallback"] = fallback_loopback<int16_t>;
+        scenarios["latency"] = latency_test<int16_t>;
     }
     else if (sample_format == "uint16") {
+        raw_format.format = Alsa::Pcm<uint16_t>::get_alsa_format();
         scenarios["playback"] = playback_test<uint16_t>;
         scenarios["loopback"] = loopback_test<uint16_t>;
         scenarios["fallback"] = fallback_loopback<uint16_t>;
+        scenarios["latency"] = latency_test<uint16_t>;
     }
     else {
         assert(!"MISSING IF-ELSES FOR FORMATS");
@@ -571,8 +2236,33 @@ int main(int argc, char *argv[]) {
             playback_pcm = *it;
         }
     }
-    set_volumes(playback_pcm, capture_pcm);
+    it = std::find(args.begin(), args.end(), std::string("--output"));
+    if (it != args.end()) { // not doing && because of sequence points
+        if (++it != args.end()) {
+            options.output = *it;
+        }
+    }
+    it = std::find(args.begin(), args.end(), std::string("--save-capture"));
+    if (it != args.end()) { // not doing && because of sequence points
+        if (++it != args.end()) {
+            options.save_capture = *it;
+        }
+    }
     std::string scenario{args[1]};
+    if (scenario == "analyse") {
+        // no devices involved, every core can take a file
+        auto paths = operands(args);
+        if (paths.empty()) {
+            std::cerr << "No recordings to analyse" << std::endl;
+            return 1;
+        }
+        unsigned jobs = jobs_given ? options.jobs :
+            std::max(1u, std::thread::hardware_concurrency());
+        return analyse_files(paths, raw_format, jobs);
+    }
+    if (scenario != "playback" || options.output.empty()) {
+        set_volumes(playback_pcm, capture_pcm);
+    }
     if (scenario == "playback") {
         return scenarios["playback"](duration, sampling_rate, capture_pcm.c_str(), playback_pcm.c_str());
     }
@@ -581,6 +2271,9 @@ int main(int argc, char *argv[]) {
         if (!error) return 0;
         return scenarios["fallback"](duration, sampling_rate, nullptr, nullptr);
     }
+    else if (scenario == "latency") {
+        return scenarios["latency"](duration, sampling_rate, capture_pcm.c_str(), playback_pcm.c_str());
+    }
     else if (scenario == "list-formats") {
         return list_formats();
     }
@@ -592,3 +2285,4 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 }
+#endif
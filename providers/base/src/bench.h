@@ -0,0 +1,101 @@
+/* bench.h - microbenchmark harness for the bench_* programs
+ *
+ * Usable from C and C++. A benchmark is a function running its operation
+ * `iterations` times. bench_run() first runs it untimed for as long as
+ * BENCH_WARMUP samples would take (page faults, caches, frequency ramp-up),
+ * then finds how many iterations fill BENCH_SAMPLE_NS, then times
+ * BENCH_SAMPLES samples and prints the median and the 95th percentile of
+ * the time per operation. The median is what to
+ * compare between builds, a p95 far above it means the machine was noisy.
+ *
+ * The program arguments, if any, are substrings of the benchmarks to run.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_WARMUP 5
+#define BENCH_SAMPLES 31
+#define BENCH_SAMPLE_NS 2000000LL   /* each sample runs for >= 2 ms */
+#define BENCH_MAX_ITERATIONS (1UL << 30)
+
+typedef void (*bench_fn)(void *arg, unsigned long iterations);
+
+/* results go through here so that the compiler can't drop the work */
+static volatile long long bench_sink;
+
+static char **bench_filters;
+static int bench_num_filters;
+
+static void bench_init(int argc, char **argv)
+{
+    bench_filters = argv + 1;
+    bench_num_filters = argc - 1;
+}
+
+static int bench_selected(const char *name)
+{
+    int i;
+    if (bench_num_filters <= 0) return 1;
+    for (i = 0; i < bench_num_filters; i++)
+        if (strstr(name, bench_filters[i])) return 1;
+    return 0;
+}
+
+static long long bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long bench_time(bench_fn fn, void *arg, unsigned long iterations)
+{
+    long long start = bench_now();
+    fn(arg, iterations);
+    return bench_now() - start;
+}
+
+static int bench_compare_ns(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(const char *name, bench_fn fn, void *arg)
+{
+    double ns[BENCH_SAMPLES];
+    unsigned long iterations;
+    long long elapsed, warm = 0;
+    int i;
+
+    if (!bench_selected(name)) return;
+    /* warm up before calibrating, samples sized on the cold calls come out
+     * far shorter than BENCH_SAMPLE_NS */
+    for (iterations = 1; warm < BENCH_WARMUP * BENCH_SAMPLE_NS &&
+         iterations < BENCH_MAX_ITERATIONS; iterations *= 2)
+        warm += bench_time(fn, arg, iterations);
+    /* calibrate, scaling up from the last batch so slow operations don't
+     * take many rounds */
+    iterations = 1;
+    while ((elapsed = bench_time(fn, arg, iterations)) < BENCH_SAMPLE_NS &&
+           iterations < BENCH_MAX_ITERATIONS) {
+        if (elapsed <= 0 || elapsed < BENCH_SAMPLE_NS / 100)
+            iterations *= 100;
+        else
+            iterations = iterations * (BENCH_SAMPLE_NS * 5 / 4) / elapsed + 1;
+    }
+    for (i = 0; i < BENCH_SAMPLES; i++)
+        ns[i] = (double)bench_time(fn, arg, iterations) / iterations;
+    qsort(ns, BENCH_SAMPLES, sizeof(ns[0]), bench_compare_ns);
+    printf("%-40s %12.1f ns median %12.1f ns p95  (%lu iterations)\n", name,
+           ns[BENCH_SAMPLES / 2], ns[(BENCH_SAMPLES * 95 + 99) / 100 - 1],
+           iterations);
+    fflush(stdout);
+}
+
+#endif /* BENCH_H */
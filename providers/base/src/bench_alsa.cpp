@@ -0,0 +1,150 @@
+// bench_alsa.cpp - microbenchmarks of the alsa_test signal processing
+//
+// Built from the alsa_test sources, see bench.h for the method. Needs no
+// audio hardware: the analysis runs on a synthetic recording and the
+// synthesis plays to the ALSA "null" PCM, which discards the samples
+// without pacing them to the sampling rate.
+#define ALSA_TEST_NO_MAIN
+#include "alsa_test.cpp"
+#include "bench.h"
+
+namespace {
+
+const unsigned bench_rate = 48000;
+
+// FFT sizes, plus the sizes of a one second recording at the usual rates,
+// which dominant_freq() zero-pads
+const size_t buffer_sizes[] = {
+    256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 44100, 48000
+};
+
+template<class storage_type> const char *type_name();
+template<> const char *type_name<float>() { return "float"; }
+template<> const char *type_name<double>() { return "double"; }
+template<> const char *type_name<int16_t>() { return "int16_t"; }
+template<> const char *type_name<uint16_t>() { return "uint16_t"; }
+template<> const char *type_name<int8_t>() { return "int8_t"; }
+template<> const char *type_name<uint8_t>() { return "uint8_t"; }
+
+// a 440 Hz tone with some noise, scaled to the range of storage_type
+template<class storage_type>
+std::vector<storage_type> recording(size_t size) {
+    const double lowest = double(std::numeric_limits<storage_type>::lowest());
+    const double highest = double(std::numeric_limits<storage_type>::max());
+    const bool is_float = std::is_floating_point<storage_type>::value;
+    const double middle = is_float ? 0.0 : (lowest + highest) / 2;
+    const double scale = is_float ? 0.5 : (highest - lowest) / 4;
+    std::vector<storage_type> buff(size);
+    uint32_t noise = 1;
+    for (size_t i = 0; i < size; ++i) {
+        noise = noise * 1664525u + 1013904223u;
+        const double sample = 0.9 * sin(2.0 * M_PI * 440.0 * i / bench_rate)
+            + 0.1 * (double(noise >> 8) / double(1u << 24) - 0.5);
+        buff[i] = storage_type(middle + scale * sample);
+    }
+    return buff;
+}
+
+struct FftBench {
+    const Dsp::RealFftPlan *plan;
+    std::vector<float> samples;
+    std::vector<Dsp::Complex> spectrum;
+};
+
+void bench_fft(void *arg, unsigned long iterations) {
+    auto *bench = static_cast<FftBench *>(arg);
+    for (unsigned long i = 0; i < iterations; ++i) {
+        bench->plan->transform(&bench->samples[0], &bench->spectrum[0]);
+    }
+    bench_sink += (long long)bench->spectrum[1].real();
+}
+
+template<class storage_type>
+struct DominantFreqBench {
+    std::vector<storage_type> buff;
+};
+
+template<class storage_type>
+void bench_dominant_freq(void *arg, unsigned long iterations) {
+    auto *bench = static_cast<DominantFreqBench<storage_type> *>(arg);
+    float freq = 0.0f;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        freq += dominant_freq<storage_type>(&bench->buff[0],
+            int(bench->buff.size()), int(bench_rate));
+    }
+    bench_sink += (long long)freq;
+}
+
+template<class storage_type>
+void bench_sine(void *arg, unsigned long iterations) {
+    auto *player = static_cast<Alsa::Pcm<storage_type> *>(arg);
+    // one period per iteration
+    const float duration = float(player->get_period()) / float(player->get_rate());
+    for (unsigned long i = 0; i < iterations; ++i) {
+        player->sine(440, duration, 0.5f);
+    }
+}
+
+void run_fft_benches() {
+    char name[64];
+    for (size_t size : buffer_sizes) {
+        if (size & (size - 1)) continue;
+        FftBench bench{&Dsp::RealFftPlan::get(size), std::vector<float>(size),
+                       std::vector<Dsp::Complex>(size / 2 + 1)};
+        auto input = recording<float>(size);
+        bench.samples.assign(input.begin(), input.end());
+        snprintf(name, sizeof(name), "fft/%zu", size);
+        bench_run(name, bench_fft, &bench);
+    }
+}
+
+template<class storage_type>
+void run_dominant_freq_benches() {
+    char name[64];
+    for (size_t size : buffer_sizes) {
+        DominantFreqBench<storage_type> bench{recording<storage_type>(size)};
+        snprintf(name, sizeof(name), "dominant_freq/%s/%zu",
+                 type_name<storage_type>(), size);
+        bench_run(name, bench_dominant_freq<storage_type>, &bench);
+    }
+}
+
+template<class storage_type>
+void run_sine_benches() {
+    char name[64];
+    for (auto access : {Alsa::Access::rw, Alsa::Access::mmap}) {
+        const char *access_name = access == Alsa::Access::rw ? "rw" : "mmap";
+        snprintf(name, sizeof(name), "sine/%s/%s/period",
+                 type_name<storage_type>(), access_name);
+        if (!bench_selected(name)) continue;
+        try {
+            Alsa::Pcm<storage_type> player("null");
+            player.set_params(bench_rate, options.channels, access);
+            if (player.get_access() != access) {
+                printf("%-40s skipped, the null PCM has no %s access\n",
+                       name, access_name);
+                continue;
+            }
+            bench_run(name, bench_sine<storage_type>, &player);
+        } catch (const Alsa::AlsaError &err) {
+            printf("%-40s skipped: %s\n", name, err.what());
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bench_init(argc, argv);
+    run_fft_benches();
+    run_dominant_freq_benches<float>();
+    run_dominant_freq_benches<int16_t>();
+    run_dominant_freq_benches<uint16_t>();
+    run_sine_benches<float>();
+    run_sine_benches<double>();
+    run_sine_benches<int16_t>();
+    run_sine_benches<uint16_t>();
+    run_sine_benches<int8_t>();
+    run_sine_benches<uint8_t>();
+    return 0;
+}
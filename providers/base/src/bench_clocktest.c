@@ -0,0 +1,31 @@
+/* bench_clocktest.c - cost of reading each of the clocktest clocks
+ *
+ * Built from the clocktest sources, see bench.h for the method. One
+ * iteration is one read_clock(), the same call the stress test (-c) makes.
+ */
+#define CLOCKTEST_NO_MAIN
+#include "clocktest.c"
+#include "bench.h"
+
+static void bench_read_clock(void *arg, unsigned long iterations)
+{
+    unsigned clock = *(const unsigned *)arg;
+    long long sum = 0;
+
+    while (iterations--)
+        sum += read_clock(clock);
+    bench_sink += sum;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned clock;
+    char name[64];
+
+    bench_init(argc, argv);
+    for (clock = 0; clock < NUM_CLOCKS; clock++) {
+        snprintf(name, sizeof(name), "read_clock/%s", clock_sources[clock].name);
+        bench_run(name, bench_read_clock, &clock);
+    }
+    return 0;
+}
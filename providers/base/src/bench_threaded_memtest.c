@@ -0,0 +1,136 @@
+/* bench_threaded_memtest.c - microbenchmarks of the threaded_memtest loops
+ *
+ * Built from the threaded_memtest sources, see bench.h for the method. One
+ * thread, no signals and no deadline: the benchmarks call the test loops
+ * directly, on regions set up the way mem_twiddler() sets up its own.
+ *
+ *   random_test/iteration  one pass of the mem_twiddler random loop
+ *   <kernel>/<op>/1MiB     the pattern kernels over 1 MiB, walking through a
+ *                          region much larger than the caches
+ */
+#define THREADED_MEMTEST_NO_MAIN
+#include "threaded_memtest.c"
+#include "bench.h"
+
+#define BENCH_REGION (64UL << 20)
+#define BENCH_SPAN (1UL << 20)
+
+struct kernel_bench {
+    const struct pattern_kernels *kernels;
+    uint64_t *p;
+    size_t words, pos;
+    uint64_t pattern;
+};
+
+static uint64_t bench_rng;
+
+static void bench_random_test(void *arg, unsigned long iterations) {
+    random_test(0,&bench_rng,NULL,1,iterations,NULL,NULL);
+}
+
+/* the next span of the region, so consecutive calls miss the caches */
+static uint64_t *next_span(struct kernel_bench *b) {
+    const size_t span = BENCH_SPAN/sizeof(uint64_t);
+    uint64_t *p = b->p+b->pos;
+    b->pos = (b->pos+span) % b->words;
+    return p;
+}
+
+static void bench_fill(void *arg, unsigned long iterations) {
+    struct kernel_bench *b = arg;
+    while (iterations--)
+        b->kernels->fill(next_span(b),BENCH_SPAN/sizeof(uint64_t),b->pattern);
+}
+
+static void bench_compare(void *arg, unsigned long iterations) {
+    struct kernel_bench *b = arg;
+    size_t sum = 0;
+    while (iterations--)
+        sum += b->kernels->compare(next_span(b),BENCH_SPAN/sizeof(uint64_t),
+                                   b->pattern);
+    bench_sink += sum;
+}
+
+static void bench_fill_addr(void *arg, unsigned long iterations) {
+    struct kernel_bench *b = arg;
+    while (iterations--)
+        b->kernels->fill_addr(next_span(b),BENCH_SPAN/sizeof(uint64_t),
+                              b->pattern);
+}
+
+static void bench_compare_addr(void *arg, unsigned long iterations) {
+    struct kernel_bench *b = arg;
+    size_t sum = 0;
+    while (iterations--)
+        sum += b->kernels->compare_addr(next_span(b),BENCH_SPAN/sizeof(uint64_t),
+                                        b->pattern);
+    bench_sink += sum;
+}
+
+static void run_kernel_benches(const struct pattern_kernels *k, uint64_t *p) {
+    struct kernel_bench b = { k, p, BENCH_REGION/sizeof(uint64_t), 0,
+                              0x5555555555555555ULL };
+    char name[64];
+    /* the compares run after the matching fills, so they scan every word */
+    snprintf(name,sizeof(name),"%s/fill/1MiB",k->name);
+    bench_run(name,bench_fill,&b);
+    k->fill(p,b.words,b.pattern);
+    snprintf(name,sizeof(name),"%s/compare/1MiB",k->name);
+    bench_run(name,bench_compare,&b);
+    snprintf(name,sizeof(name),"%s/fill_addr/1MiB",k->name);
+    bench_run(name,bench_fill_addr,&b);
+    k->fill_addr(p,b.words,b.pattern);
+    snprintf(name,sizeof(name),"%s/compare_addr/1MiB",k->name);
+    bench_run(name,bench_compare_addr,&b);
+}
+
+int main(int argc, char **argv) {
+    struct pattern_kernels scalar = kernels;
+    unsigned long size = BENCH_REGION, pagesize, i;
+    char *region;
+    long *lp;
+
+    bench_init(argc,argv);
+    num_threads = 1;
+    num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    seed = 1;
+    bench_rng = rng_seed(0);
+    if (posix_memalign((void **)&stats,CACHE_LINE,sizeof(*stats)) != 0 ||
+        posix_memalign((void **)&error_rings,CACHE_LINE,sizeof(*error_rings)) != 0) {
+        perror("posix_memalign"); return 1;
+    }
+    memset(stats,0,sizeof(*stats));
+    memset(error_rings,0,sizeof(*error_rings));
+    mmap_regions = malloc(sizeof(char *));
+    region_pages = malloc(sizeof(unsigned long));
+    region_pagesize = malloc(sizeof(unsigned long));
+    active_pages = malloc(sizeof(atomic_ulong));
+    pagemap_fd = -1;
+
+    /* the random test region, with the page headers mem_twiddler() writes */
+    region = map_region(&size,&pagesize);
+    if (region == MAP_FAILED) { perror("mmap"); return 1; }
+    mmap_regions[0] = region;
+    region_pages[0] = size/pagesize;
+    region_pagesize[0] = pagesize;
+    atomic_store(&active_pages[0],region_pages[0]);
+    for (i=0;i<region_pages[0];i++) {
+        lp=(long *)&(region[i*pagesize]);
+        lp[0]=0xDEADBEEF;
+        lp[1]=0;
+        lp[2]=i;
+    }
+    bench_run("random_test/iteration",bench_random_test,NULL);
+
+    /* the pattern kernels get a region of their own, faulted in up front
+     * so that the first fill doesn't time the page faults */
+    size = BENCH_REGION;
+    region = map_region(&size,&pagesize);
+    if (region == MAP_FAILED) { perror("mmap"); return 1; }
+    memset(region,0,size);
+    select_kernels();
+    run_kernel_benches(&scalar,(uint64_t *)region);
+    if (strcmp(kernels.name,scalar.name) != 0)
+        run_kernel_benches(&kernels,(uint64_t *)region);
+    return stats[0].errors != 0;
+}
@@ -3,11 +3,16 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
-#include <sys/time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #define __USE_GNU 1
 #include <sched.h>
+#include <pthread.h>
 
 #define NSEC_PER_SEC    1000000000
 #define MAX_JITTER      (double)0.2
@@ -89,77 +94,931 @@ int test_clock_jitter(){
 }
 
 /*
- * This is the original test_clock_direction() function. I've left it here for
- * reference and in case we wish to resurrect it for some reason. 
- * This should be removed in the future if the new version pans out.
-int test_clock_direction()
-{
-	time_t starttime = 0;
-	time_t stoptime = 0;
-	int sleeptime = 60;
-	float delta = 0;
-
-	time(&starttime);
-	sleep(sleeptime);
-	time(&stoptime);
-
-	delta = (int)stoptime - (int)starttime - sleeptime;
-	printf("clock direction test: start time %d, stop time %d, sleeptime %u, delta %f\n",
-				(int)starttime, (int)stoptime, sleeptime, delta);
-	if (delta != 0)
-	{
-		printf("FAILED\n");
-		return 1;
-	}
-	/// * otherwise * /
-	printf("PASSED\n");
-	return 0;
-}*/
-
-int test_clock_direction()
-{
-    struct timeval tval_start, tval_stop, tval_result;
-    int sleeptime = 60;
+ * Parallel skew test: one thread pinned to each CPU, and every pair of
+ * CPUs plays ping-pong over a shared cache line. The initiator reads its
+ * clock (t1) and pings, the responder reads its clock (t2) and answers,
+ * the initiator reads its clock again (t3). The responder's reading was
+ * taken between the other two, so its clock is ahead by at least t2-t3 and
+ * at most t2-t1; the tightest bounds over all the samples bound the real
+ * offset. All the pairs of a round run at the same time (round-robin
+ * scheduling), so it's N-1 rounds of a few ms rather than N*ITERATIONS
+ * migrations.
+ */
+#define SKEW_SAMPLES    1000
+#define MAX_SKEW_NS     1000
+#define CACHE_LINE      64
+
+struct skew_line {
+    atomic_ulong seq;
+    atomic_llong stamp;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct skew_test {
+    unsigned num_cpus, players; /* players is num_cpus rounded up to even */
+    int *cpus;
+    long long *lower, *upper;   /* [a*num_cpus+b]: bounds of b's offset */
+    struct skew_line *lines;
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+static long long now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec*NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* the opponent of `player` in `round`, with the last player fixed and the
+ * others rotating around it */
+static unsigned opponent(unsigned player, unsigned round, unsigned players)
+{
+    unsigned n = players - 1;
+    if (player == n) return round;
+    if (player == round) return n;
+    return (2*round + n - player) % n;
+}
+
+/* the CPUs we may run on, NULL on error */
+static int *allowed_cpus(unsigned *count)
+{
+    cpu_set_t allowed;
+    unsigned cpu, n;
+    int *cpus;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity"); return NULL;
+    }
+    *count = CPU_COUNT(&allowed);
+    cpus = malloc(*count * sizeof(int));
+    for (cpu = 0, n = 0; n < *count; cpu++)
+        if (CPU_ISSET(cpu, &allowed)) cpus[n++] = cpu;
+    return cpus;
+}
+
+struct skew_thread {
+    struct skew_test *test;
+    unsigned player;
+};
+
+static void *skew_thread(void *arg)
+{
+    struct skew_thread *me = arg;
+    struct skew_test *test = me->test;
+    cpu_set_t cpumask;
+    unsigned round, k;
+
+    CPU_ZERO(&cpumask); CPU_SET(test->cpus[me->player], &cpumask);
+    if (setaffinity(cpumask) < 0) {
+        perror("sched_setaffinity"); test->failed = 1;
+    }
+    for (round = 0; round < test->players - 1; round++) {
+        unsigned other = opponent(me->player, round, test->players);
+        unsigned a = me->player < other ? me->player : other;
+        unsigned long base = (unsigned long)round*2*SKEW_SAMPLES;
+        /* each pair gets the line of its lower player */
+        struct skew_line *line = &test->lines[a];
+        pthread_barrier_wait(&test->barrier);
+        if (other >= test->num_cpus || test->failed)
+            continue; /* a bye */
+        if (me->player == a) {
+            long long lower = LLONG_MIN, upper = LLONG_MAX;
+            for (k = 0; k < SKEW_SAMPLES; k++) {
+                long long t1, t2, t3;
+                t1 = now_ns(CLOCK_MONOTONIC);
+                atomic_store_explicit(&line->seq, base+2*k+1,
+                                      memory_order_release);
+                while (atomic_load_explicit(&line->seq, memory_order_acquire)
+                       != base+2*k+2)
+                    ;
+                t3 = now_ns(CLOCK_MONOTONIC);
+                t2 = atomic_load_explicit(&line->stamp, memory_order_relaxed);
+                if (t2 - t3 > lower) lower = t2 - t3;
+                if (t2 - t1 < upper) upper = t2 - t1;
+            }
+            test->lower[a*test->num_cpus+other] = lower;
+            test->upper[a*test->num_cpus+other] = upper;
+        } else {
+            for (k = 0; k < SKEW_SAMPLES; k++) {
+                while (atomic_load_explicit(&line->seq, memory_order_acquire)
+                       != base+2*k+1)
+                    ;
+                atomic_store_explicit(&line->stamp, now_ns(CLOCK_MONOTONIC),
+                                      memory_order_relaxed);
+                atomic_store_explicit(&line->seq, base+2*k+2,
+                                      memory_order_release);
+            }
+        }
+    }
+    return NULL;
+}
+
+int test_clock_skew(long long max_skew)
+{
+    struct skew_test test;
+    struct skew_thread *args;
+    pthread_t *threads;
+    unsigned a, b, worst_a = 0, worst_b = 0;
+    long long start, worst = 0, widest = 0;
+    int failures = 0;
+
+    test.cpus = allowed_cpus(&test.num_cpus);
+    if (!test.cpus)
+        return 1;
+    if (test.num_cpus == 1) {
+        printf("Single CPU detected. No clock skew testing necessary.\n");
+        free(test.cpus);
+        return 0;
+    }
+    test.players = (test.num_cpus + 1) & ~1U;
+    test.lower = calloc(test.num_cpus * test.num_cpus, sizeof(long long));
+    test.upper = calloc(test.num_cpus * test.num_cpus, sizeof(long long));
+    if (posix_memalign((void **)&test.lines, CACHE_LINE,
+                       test.players * sizeof(struct skew_line)) != 0) {
+        perror("posix_memalign"); return 1;
+    }
+    memset(test.lines, 0, test.players * sizeof(struct skew_line));
+    pthread_barrier_init(&test.barrier, NULL, test.num_cpus);
+    test.failed = 0;
+    threads = malloc(test.num_cpus * sizeof(pthread_t));
+    args = malloc(test.num_cpus * sizeof(struct skew_thread));
+
+    printf("Testing for clock skew on %u cpus\n", test.num_cpus);
+    start = now_ns(CLOCK_MONOTONIC);
+    for (a = 0; a < test.num_cpus; a++) {
+        args[a].test = &test;
+        args[a].player = a;
+        if (pthread_create(&threads[a], NULL, skew_thread, &args[a]) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+    }
+    for (a = 0; a < test.num_cpus; a++)
+        pthread_join(threads[a], NULL);
+    if (test.failed)
+        return 1;
+
+    for (a = 0; a < test.num_cpus; a++) {
+        for (b = a + 1; b < test.num_cpus; b++) {
+            long long lower = test.lower[a*test.num_cpus+b];
+            long long upper = test.upper[a*test.num_cpus+b];
+            /* how far the interval is from 0 is the skew we can prove */
+            long long skew = lower > 0 ? lower : upper < 0 ? -upper : 0;
+            if (upper - lower > widest) widest = upper - lower;
+            if (skew > worst) { worst = skew; worst_a = a; worst_b = b; }
+            if (skew > max_skew) {
+                if (failures++ < 10)
+                    printf("ERROR: cpu %d is %lld to %lld ns ahead of cpu %d\n",
+                           test.cpus[b], lower, upper, test.cpus[a]);
+            }
+        }
+    }
+    printf("Largest skew seen was %lld ns (cpu %d,%d), "
+           "measured to within %lld ns\n", worst,
+           test.cpus[worst_a], test.cpus[worst_b], widest);
+    printf("Skew test took %.3f s\n",
+           (double)(now_ns(CLOCK_MONOTONIC) - start) / NSEC_PER_SEC);
+    if (failures == 0)
+        printf("PASSED: no skew larger than %lld ns\n", max_skew);
+    else
+        printf("FAILED: %u cpu pairs are more than %lld ns apart\n",
+               failures, max_skew);
+
+    pthread_barrier_destroy(&test.barrier);
+    free(test.cpus); free(test.lower); free(test.upper); free(test.lines);
+    free(threads); free(args);
+    return (failures > 0);
+}
+
+/*
+ * Clock stress test: every clock is read in a tight loop by one thread
+ * pinned to each CPU, first alone to time a read, then against a shared
+ * "latest reading" that each thread compares its own readings with. The
+ * latest reading was taken before we loaded it, so a later reading on any
+ * CPU smaller than it means the clock went backwards.
+ */
+#define STRESS_NS       (250*1000*1000LL) /* per clock and phase */
+#define STRESS_BATCH    1024
+#define SLOW_READ_NS    200
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long read_rdtsc(void)
+{
+    unsigned lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+/* rdtscp waits for the earlier instructions, so it can't be read early */
+static inline unsigned long long read_rdtscp(void)
+{
+    unsigned lo, hi, aux;
+    __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return ((unsigned long long)hi << 32) | lo;
+}
+#elif defined(__aarch64__)
+static inline unsigned long long read_cntvct(void)
+{
+    unsigned long long v;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+}
+#endif
+
+enum {
+    CLK_REALTIME, CLK_MONOTONIC, CLK_MONOTONIC_RAW, CLK_MONOTONIC_COARSE,
+#if defined(__x86_64__) || defined(__i386__)
+    CLK_RDTSC, CLK_RDTSCP,
+#elif defined(__aarch64__)
+    CLK_CNTVCT,
+#endif
+    NUM_CLOCKS
+};
+
+struct clock_source {
+    const char *name;
+    clockid_t id;       /* for the clock_gettime() ones */
+    int monotonic;      /* going backwards is a failure */
+    int counter;        /* readings are ticks rather than ns */
+};
+
+static const struct clock_source clock_sources[NUM_CLOCKS] = {
+    { "CLOCK_REALTIME", CLOCK_REALTIME, 0, 0 },
+    { "CLOCK_MONOTONIC", CLOCK_MONOTONIC, 1, 0 },
+    { "CLOCK_MONOTONIC_RAW", CLOCK_MONOTONIC_RAW, 1, 0 },
+    { "CLOCK_MONOTONIC_COARSE", CLOCK_MONOTONIC_COARSE, 1, 0 },
+#if defined(__x86_64__) || defined(__i386__)
+    { "rdtsc", 0, 0, 1 },
+    { "rdtscp", 0, 1, 1 },
+#elif defined(__aarch64__)
+    { "cntvct_el0", 0, 1, 1 },
+#endif
+};
+
+static inline long long read_clock(unsigned clock)
+{
+    switch (clock) {
+#if defined(__x86_64__) || defined(__i386__)
+        case CLK_RDTSC: return read_rdtsc();
+        case CLK_RDTSCP: return read_rdtscp();
+#elif defined(__aarch64__)
+        case CLK_CNTVCT: return read_cntvct();
+#endif
+        default: return now_ns(clock_sources[clock].id);
+    }
+}
+
+struct stress_result {
+    double ns_per_read;
+    unsigned long long local_backwards, cross_backwards;
+    long long worst;    /* largest step back */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct stress_test {
+    unsigned num_cpus;
+    int *cpus;
+    struct stress_result *results;   /* [cpu*NUM_CLOCKS+clock] */
+    atomic_llong latest[NUM_CLOCKS];
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+struct stress_thread {
+    struct stress_test *test;
+    unsigned index;
+};
+
+static void *stress_thread(void *arg)
+{
+    struct stress_thread *me = arg;
+    struct stress_test *test = me->test;
+    cpu_set_t cpumask;
+    unsigned clock, i;
+
+    CPU_ZERO(&cpumask); CPU_SET(test->cpus[me->index], &cpumask);
+    if (setaffinity(cpumask) < 0) {
+        perror("sched_setaffinity"); test->failed = 1;
+    }
+    for (clock = 0; clock < NUM_CLOCKS; clock++) {
+        struct stress_result *res =
+            &test->results[me->index*NUM_CLOCKS+clock];
+        atomic_llong *latest = &test->latest[clock];
+        long long start, end, reads = 0, last;
+        volatile long long sink;
+
+        /* the cost of a read, nothing else in the loop */
+        pthread_barrier_wait(&test->barrier);
+        start = end = now_ns(CLOCK_MONOTONIC);
+        while (end - start < STRESS_NS) {
+            for (i = 0; i < STRESS_BATCH; i++)
+                sink = read_clock(clock);
+            reads += STRESS_BATCH;
+            end = now_ns(CLOCK_MONOTONIC);
+        }
+        (void)sink;
+        res->ns_per_read = (double)(end - start) / reads;
+
+        /* monotonicity, on this CPU and against all the others */
+        pthread_barrier_wait(&test->barrier);
+        last = read_clock(clock);
+        start = end = now_ns(CLOCK_MONOTONIC);
+        while (end - start < STRESS_NS) {
+            for (i = 0; i < STRESS_BATCH; i++) {
+                long long seen = atomic_load_explicit(latest,
+                                                      memory_order_acquire);
+                long long now = read_clock(clock);
+                if (now < last) {
+                    res->local_backwards++;
+                    if (last - now > res->worst) res->worst = last - now;
+                }
+                if (now < seen) {
+                    res->cross_backwards++;
+                    if (seen - now > res->worst) res->worst = seen - now;
+                }
+                while (now > seen &&
+                       !atomic_compare_exchange_weak(latest, &seen, now))
+                    ;
+                last = now;
+            }
+            end = now_ns(CLOCK_MONOTONIC);
+        }
+    }
+    return NULL;
+}
+
+/* the kernel's clocksource, "unknown" if it can't be read */
+static void current_clocksource(char *buf, size_t len)
+{
+    FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/"
+                    "current_clocksource", "r");
+    snprintf(buf, len, "unknown");
+    if (f) {
+        if (fgets(buf, len, f)) buf[strcspn(buf, "\n")] = '\0';
+        fclose(f);
+    }
+}
+
+int test_clock_stress()
+{
+    struct stress_test test;
+    struct stress_thread *args;
+    pthread_t *threads;
+    char clocksource[64];
+    unsigned clock, t;
+    int failures = 0;
+
+    test.cpus = allowed_cpus(&test.num_cpus);
+    if (!test.cpus)
+        return 1;
+    if (posix_memalign((void **)&test.results, CACHE_LINE,
+                       test.num_cpus*NUM_CLOCKS*sizeof(struct stress_result))) {
+        perror("posix_memalign"); return 1;
+    }
+    memset(test.results, 0,
+           test.num_cpus*NUM_CLOCKS*sizeof(struct stress_result));
+    for (clock = 0; clock < NUM_CLOCKS; clock++)
+        atomic_init(&test.latest[clock], LLONG_MIN);
+    pthread_barrier_init(&test.barrier, NULL, test.num_cpus);
+    test.failed = 0;
+    threads = malloc(test.num_cpus * sizeof(pthread_t));
+    args = malloc(test.num_cpus * sizeof(struct stress_thread));
+    current_clocksource(clocksource, sizeof(clocksource));
+
+    printf("Stressing %u clocks on %u cpus, clocksource is %s\n",
+           NUM_CLOCKS, test.num_cpus, clocksource);
+    for (t = 0; t < test.num_cpus; t++) {
+        args[t].test = &test;
+        args[t].index = t;
+        if (pthread_create(&threads[t], NULL, stress_thread, &args[t]) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+    }
+    for (t = 0; t < test.num_cpus; t++)
+        pthread_join(threads[t], NULL);
+    if (test.failed)
+        return 1;
+
+    for (clock = 0; clock < NUM_CLOCKS; clock++) {
+        const struct clock_source *src = &clock_sources[clock];
+        double sum = 0, slowest = 0;
+        unsigned long long local = 0, cross = 0;
+        long long worst = 0;
+        int slowest_cpu = 0;
+        for (t = 0; t < test.num_cpus; t++) {
+            struct stress_result *res = &test.results[t*NUM_CLOCKS+clock];
+            sum += res->ns_per_read;
+            if (res->ns_per_read > slowest) {
+                slowest = res->ns_per_read; slowest_cpu = test.cpus[t];
+            }
+            local += res->local_backwards;
+            cross += res->cross_backwards;
+            if (res->worst > worst) worst = res->worst;
+        }
+        printf("%s: %.1f ns/read (slowest %.1f on cpu %d), "
+               "%llu backwards on the same cpu, %llu across cpus\n",
+               src->name, sum / test.num_cpus, slowest, slowest_cpu,
+               local, cross);
+        if (!local && !cross)
+            continue;
+        /* the counters only have to agree when the kernel trusts them */
+        if (src->monotonic && (!src->counter ||
+                               !strcmp(clocksource, "tsc") ||
+                               !strcmp(clocksource, "arch_sys_counter"))) {
+            printf("ERROR: %s went backwards by up to %lld %s\n",
+                   src->name, worst, src->counter ? "ticks" : "ns");
+            failures++;
+        } else {
+            printf("WARNING: %s went backwards by up to %lld %s\n",
+                   src->name, worst, src->counter ? "ticks" : "ns");
+        }
+    }
+    if (test.results[CLK_MONOTONIC].ns_per_read > SLOW_READ_NS)
+        printf("WARNING: CLOCK_MONOTONIC takes more than %d ns to read, "
+               "the %s clocksource is slow\n", SLOW_READ_NS, clocksource);
+
+    if (failures == 0)
+        printf("PASSED: no clock went backwards\n");
+    else
+        printf("FAILED: %u clocks went backwards\n", failures);
+
+    pthread_barrier_destroy(&test.barrier);
+    free(test.cpus); free(test.results); free(threads); free(args);
+    return (failures > 0);
+}
+
+/*
+ * Drift test: sample the clocks against CLOCK_MONOTONIC_RAW, which runs
+ * off the hardware counter without NTP's corrections, every
+ * DRIFT_INTERVAL_NS and fit a line through their offsets. The slope is
+ * the drift rate, the residuals are the jitter. The fit is updated with
+ * every sample, and the test stops as soon as the 95% confidence interval
+ * of every slope is narrow and clear of the limit (or after
+ * DRIFT_MAX_SECONDS, the five minutes the old 5x60s test took, however
+ * many samples were kept by then).
+ */
+#define DRIFT_INTERVAL_NS   1000000     /* 1 ms */
+#define DRIFT_MIN_SECONDS   5
+#define DRIFT_MAX_SECONDS   300
+#define DRIFT_PRECISION_PPM 1.0         /* half width of the interval */
+/* the old test allowed 0.01 s per 60 s sleep */
+#define MAX_DRIFT_PPM       (0.01 / 60 * 1e6)
+/* samples where reading the clock took longer than this were preempted */
+#define DRIFT_MAX_READ_NS   20000
+#define STEP_NS             1000000     /* an offset jump counted as a step */
+#define JITTER_BUCKETS      16          /* log2 of the residual in ns */
+
+enum { DRIFT_REALTIME, DRIFT_MONOTONIC, DRIFT_CLOCKS };
+
+struct drift_fit {
+    const char *name;
+    clockid_t id;
+    long long base;     /* first offset, so the doubles keep their precision */
+    double last;
+    /* running means and sums of squares, Welford style */
+    unsigned long n;
+    double mean_x, mean_y, sxx, sxy, syy;
+    unsigned long steps, backwards;
+    long long last_reading;
+    float *x, *y;       /* every sample, for the residuals */
+};
+
+static void fit_add(struct drift_fit *fit, double x, double y)
+{
+    double dx = x - fit->mean_x, dy = y - fit->mean_y;
+    fit->n++;
+    fit->mean_x += dx / fit->n;
+    fit->mean_y += dy / fit->n;
+    fit->sxx += dx * (x - fit->mean_x);
+    fit->sxy += dx * (y - fit->mean_y);
+    fit->syy += dy * (y - fit->mean_y);
+}
+
+/* slope in ppm (ns per ms), and the half width of its 95% interval */
+static double fit_slope(const struct drift_fit *fit, double *half)
+{
+    double slope, var;
+    if (fit->n < 3 || fit->sxx <= 0) {
+        *half = INFINITY;
+        return 0;
+    }
+    slope = fit->sxy / fit->sxx;
+    var = (fit->syy - slope * fit->sxy) / (fit->n - 2);
+    *half = 1.96 * sqrt((var > 0 ? var : 0) / fit->sxx) / 1000;
+    return slope / 1000;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_jitter(const struct drift_fit *fit)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    unsigned long hist[JITTER_BUCKETS] = { 0 };
+    double half, slope = fit_slope(fit, &half) * 1000;
+    double *res = malloc(fit->n * sizeof(double));
+    unsigned long i;
+    unsigned b;
+
+    if (!res) { perror("malloc"); return; }
+    for (i = 0; i < fit->n; i++) {
+        double r = fit->y[i] - fit->mean_y - slope * (fit->x[i] - fit->mean_x);
+        res[i] = fabs(r);
+        for (b = 0; b < JITTER_BUCKETS - 1 && res[i] >= (double)(1UL << b); b++)
+            ;
+        hist[b]++;
+    }
+    qsort(res, fit->n, sizeof(double), compare_doubles);
+    printf("  jitter:");
+    for (b = 0; b < sizeof(percentiles) / sizeof(percentiles[0]); b++)
+        printf(" p%g %.0f ns,", percentiles[b],
+               res[(unsigned long)(percentiles[b] / 100 * (fit->n - 1))]);
+    printf(" max %.0f ns\n", res[fit->n - 1]);
+    printf("  histogram:");
+    for (b = 0; b < JITTER_BUCKETS - 1; b++)
+        if (hist[b]) printf(" <%luns:%lu", 1UL << b, hist[b]);
+    if (hist[b]) printf(" >=%luns:%lu", 1UL << b, hist[b]);
+    printf("\n");
+    free(res);
+}
+
+int test_clock_drift()
+{
+    struct drift_fit fits[DRIFT_CLOCKS] = {
+        { .name = "CLOCK_REALTIME", .id = CLOCK_REALTIME },
+        { .name = "CLOCK_MONOTONIC", .id = CLOCK_MONOTONIC },
+    };
+    unsigned long max_samples = DRIFT_MAX_SECONDS * (NSEC_PER_SEC / DRIFT_INTERVAL_NS);
+    unsigned long dropped = 0;
+    long long start, deadline, ref;
+    struct timespec next;
+    unsigned c;
+    int failures = 0, done = 0;
+
+    printf("\nTesting clock drift against CLOCK_MONOTONIC_RAW, "
+           "for up to %d seconds...\n", DRIFT_MAX_SECONDS);
+    for (c = 0; c < DRIFT_CLOCKS; c++) {
+        fits[c].x = malloc(max_samples * sizeof(float));
+        fits[c].y = malloc(max_samples * sizeof(float));
+        if (!fits[c].x || !fits[c].y) { perror("malloc"); return 1; }
+        fits[c].base = LLONG_MIN;
+    }
+
+    start = now_ns(CLOCK_MONOTONIC_RAW);
+    deadline = start + (long long)DRIFT_MAX_SECONDS * NSEC_PER_SEC;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!done && fits[0].n < max_samples) {
+        long long ref1, ref2, readings[DRIFT_CLOCKS];
+        double x;
+
+        next.tv_nsec += DRIFT_INTERVAL_NS;
+        if (next.tv_nsec >= NSEC_PER_SEC) {
+            next.tv_nsec -= NSEC_PER_SEC; next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        /* bracket the readings with the reference */
+        ref1 = now_ns(CLOCK_MONOTONIC_RAW);
+        for (c = 0; c < DRIFT_CLOCKS; c++)
+            readings[c] = now_ns(fits[c].id);
+        ref2 = now_ns(CLOCK_MONOTONIC_RAW);
+        /* dropped samples don't count towards max_samples */
+        if (ref2 >= deadline)
+            break;
+        if (ref2 - ref1 > DRIFT_MAX_READ_NS) {
+            dropped++;
+            continue;
+        }
+        ref = ref1 + (ref2 - ref1) / 2;
+        x = (double)(ref - start) / NSEC_PER_SEC;
+
+        for (c = 0; c < DRIFT_CLOCKS; c++) {
+            struct drift_fit *fit = &fits[c];
+            double y;
+            if (fit->base == LLONG_MIN) fit->base = readings[c] - ref;
+            else if (readings[c] < fit->last_reading) fit->backwards++;
+            fit->last_reading = readings[c];
+            y = (double)(readings[c] - ref - fit->base);
+            if (fit->n && fabs(y - fit->last) > STEP_NS) fit->steps++;
+            fit->last = y;
+            fit->x[fit->n] = x;
+            fit->y[fit->n] = y;
+            fit_add(fit, x, y);
+        }
+
+        /* once a second, see if we know enough */
+        if (fits[0].n % (NSEC_PER_SEC / DRIFT_INTERVAL_NS) == 0 &&
+            x >= DRIFT_MIN_SECONDS) {
+            done = 1;
+            for (c = 0; c < DRIFT_CLOCKS; c++) {
+                double half, drift = fabs(fit_slope(&fits[c], &half));
+                if (half > DRIFT_PRECISION_PPM ||
+                    (drift - half < MAX_DRIFT_PPM && drift + half > MAX_DRIFT_PPM))
+                    done = 0;
+            }
+        }
+    }
+
+    printf("%lu samples over %.1f s (%lu preempted ones dropped)\n",
+           fits[0].n, (double)(now_ns(CLOCK_MONOTONIC_RAW) - start) / NSEC_PER_SEC,
+           dropped);
+    for (c = 0; c < DRIFT_CLOCKS; c++) {
+        struct drift_fit *fit = &fits[c];
+        double half, drift = fit_slope(fit, &half);
+        if (isinf(half)) {
+            printf("FAILED: %s: too few samples to fit a line\n", fit->name);
+            failures++;
+            free(fit->x); free(fit->y);
+            continue;
+        }
+        printf("%s: drift %+.3f ppm +/- %.3f ppm, %lu steps, %lu backwards\n",
+               fit->name, drift, half, fit->steps, fit->backwards);
+        if (fit->n) print_jitter(fit);
+        if (fabs(drift) > MAX_DRIFT_PPM) {
+            printf("FAILED: %s drifts by more than %.0f ppm\n",
+                   fit->name, MAX_DRIFT_PPM);
+            failures++;
+        }
+        /* the wall clock may be stepped, the monotonic one mustn't */
+        if (fit->id == CLOCK_MONOTONIC && fit->backwards) {
+            printf("FAILED: %s went backwards\n", fit->name);
+            failures++;
+        }
+        free(fit->x); free(fit->y);
+    }
+    if (failures == 0)
+        printf("PASSED: clock drift within %.0f ppm\n", MAX_DRIFT_PPM);
+    return (failures > 0);
+}
+
+/*
+ * Wakeup latency test, in the manner of cyclictest: one thread pinned to
+ * each CPU sleeps until the next multiple of the interval with
+ * clock_nanosleep(TIMER_ABSTIME) and records how late it woke up, into
+ * its own histogram with 1 us buckets. SMIs, deep C-states and
+ * misbehaving firmware show up as the long tail.
+ */
+#define LATENCY_INTERVAL_US 1000
+#define LATENCY_SECONDS     10
+#define LATENCY_HIST_US     10000   /* the last bucket takes the rest */
+
+struct latency_test {
+    unsigned num_cpus;
+    int *cpus;
+    long long interval, duration;   /* ns */
+    int priority;                   /* SCHED_FIFO priority, 0 for none */
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+struct latency_thread {
+    struct latency_test *test;
+    unsigned index;
+    unsigned long long wakeups, overruns;
+    long long min, max, sum;        /* ns */
+    unsigned *hist;
+} __attribute__((aligned(CACHE_LINE)));
+
+static void *latency_thread(void *arg)
+{
+    struct latency_thread *me = arg;
+    struct latency_test *test = me->test;
+    cpu_set_t cpumask;
+    struct timespec ts;
+    long long next, end;
+    int err;
+
+    CPU_ZERO(&cpumask); CPU_SET(test->cpus[me->index], &cpumask);
+    if (setaffinity(cpumask) < 0) {
+        perror("sched_setaffinity"); test->failed = 1;
+    }
+    if (test->priority) {
+        struct sched_param param = { .sched_priority = test->priority };
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+            fprintf(stderr, "SCHED_FIFO: %s\n", strerror(err));
+            test->failed = 1;
+        }
+    }
+    me->min = LLONG_MAX;
+    pthread_barrier_wait(&test->barrier);
+    if (test->failed)
+        return NULL;
+
+    next = now_ns(CLOCK_MONOTONIC) + test->interval;
+    end = next + test->duration;
+    while (next < end) {
+        long long now, latency;
+        ts.tv_sec = next / NSEC_PER_SEC;
+        ts.tv_nsec = next % NSEC_PER_SEC;
+        err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (err) {
+            fprintf(stderr, "clock_nanosleep: %s\n", strerror(err));
+            test->failed = 1;
+            return NULL;
+        }
+        now = now_ns(CLOCK_MONOTONIC);
+        latency = now - next;
+        me->wakeups++;
+        me->sum += latency;
+        if (latency < me->min) me->min = latency;
+        if (latency > me->max) me->max = latency;
+        me->hist[latency / 1000 < LATENCY_HIST_US ?
+                 latency / 1000 : LATENCY_HIST_US]++;
+        /* if we slept through whole intervals, don't try to catch up */
+        next += test->interval;
+        while (next <= now) {
+            next += test->interval;
+            me->overruns++;
+        }
+    }
+    return NULL;
+}
+
+/* microsecond below which `pct` percent of the wakeups were */
+static unsigned hist_percentile(const unsigned *hist,
+                                unsigned long long count, double pct)
+{
+    unsigned long long seen = 0, target = count * pct / 100;
+    unsigned us;
+    for (us = 0; us < LATENCY_HIST_US; us++) {
+        seen += hist[us];
+        if (seen > target) break;
+    }
+    return us;
+}
+
+int test_wakeup_latency(long long interval_us, long long seconds,
+                        int priority, long long max_us)
+{
+    struct latency_test test;
+    struct latency_thread *threads_data;
+    pthread_t *threads;
+    unsigned t;
     int failures = 0;
-    int iteration;
-    double deltas[5];
-    
-    printf("\nTesting clock direction for 5 minutes...\n");
-    /* Because skew can vary, we'll run it 5 times */
-    for (iteration = 0; iteration < 5; iteration++) {
-        /* Replace time() calls with POSIX gettimeofday() */
-        gettimeofday(&tval_start, NULL);
-        sleep(sleeptime);
-        gettimeofday(&tval_stop, NULL);
- 
-        /* timersub() gives us the delta pretty simply */
-        timersub(&tval_stop, &tval_start, &tval_result);
-        deltas[iteration] = (tval_result.tv_sec - sleeptime) + (tval_result.tv_usec / 1000000.0);
-    }
-
-    for (iteration = 0; iteration < 5; iteration++) {
-        /* if any one iteration fails, test fails */
-        if (deltas[iteration] > 0.01)
-        {
-            printf("FAILED: Iteration %d delta: %f\n", iteration, deltas[iteration]);
-            failures += 1;
-        }
-        /* otherwise */
-        else {
-            printf("PASSED: Iteration %d delta: %f\n", iteration, deltas[iteration]);
-        }
-    }
-    printf("clock direction test: sleeptime %u sec per iteration, failed iterations: %d\n",
-            sleeptime, failures);
-    return (failures > 2);
-}
-
-int main()
-{
-    int failures = test_clock_jitter();
+
+    test.cpus = allowed_cpus(&test.num_cpus);
+    if (!test.cpus)
+        return 1;
+    test.interval = interval_us * 1000;
+    test.duration = seconds * NSEC_PER_SEC;
+    test.priority = priority;
+    test.failed = 0;
+    pthread_barrier_init(&test.barrier, NULL, test.num_cpus);
+    if (posix_memalign((void **)&threads_data, CACHE_LINE,
+                       test.num_cpus * sizeof(struct latency_thread))) {
+        perror("posix_memalign"); return 1;
+    }
+    memset(threads_data, 0, test.num_cpus * sizeof(struct latency_thread));
+    threads = malloc(test.num_cpus * sizeof(pthread_t));
+    /* page faults in the loop would be counted as latency */
+    if (priority && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("mlockall");
+
+    printf("Measuring wakeup latency on %u cpus, every %lld us for %lld s%s\n",
+           test.num_cpus, interval_us, seconds,
+           priority ? " under SCHED_FIFO" : "");
+    for (t = 0; t < test.num_cpus; t++) {
+        threads_data[t].test = &test;
+        threads_data[t].index = t;
+        threads_data[t].hist = calloc(LATENCY_HIST_US + 1, sizeof(unsigned));
+        if (!threads_data[t].hist) { perror("calloc"); exit(1); }
+        if (pthread_create(&threads[t], NULL, latency_thread,
+                           &threads_data[t]) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+    }
+    for (t = 0; t < test.num_cpus; t++)
+        pthread_join(threads[t], NULL);
+    if (test.failed)
+        return 1;
+
+    for (t = 0; t < test.num_cpus; t++) {
+        struct latency_thread *res = &threads_data[t];
+        if (!res->wakeups) continue;
+        printf("cpu %d: min %.1f us, avg %.1f us, p99 %u us, max %.1f us "
+               "(%llu wakeups, %llu overruns)\n", test.cpus[t],
+               res->min / 1000.0, (double)res->sum / res->wakeups / 1000,
+               hist_percentile(res->hist, res->wakeups, 99),
+               res->max / 1000.0, res->wakeups, res->overruns);
+        if (max_us && res->max > max_us * 1000) {
+            printf("ERROR: cpu %d woke up %.1f us late\n",
+                   test.cpus[t], res->max / 1000.0);
+            failures++;
+        }
+        free(res->hist);
+    }
+    if (max_us) {
+        if (failures == 0)
+            printf("PASSED: all wakeups within %lld us\n", max_us);
+        else
+            printf("FAILED: %d cpus woke up more than %lld us late\n",
+                   failures, max_us);
+    }
+
+    pthread_barrier_destroy(&test.barrier);
+    free(test.cpus); free(threads_data); free(threads);
+    return (failures > 0);
+}
+
+/* bench_clocktest.c includes this file to get at the tests above, without
+ * the command line handling */
+#ifndef CLOCKTEST_NO_MAIN
+void usage(const char *name)
+{
+    printf("Usage: %s [-s] [-m ns] [-c] [-h]\n"
+           "       %s -l [-i us] [-d s] [-p prio] [-M us]\n", name, name);
+    printf("  -s: measure the clock skew between all the CPUs in parallel,\n"
+           "      instead of the serial jitter test\n");
+    printf("  -m: largest skew allowed by -s, in ns (default %d)\n",
+           MAX_SKEW_NS);
+    printf("  -c: read every clock on all the CPUs at once, report the\n"
+           "      cost of a read and any clock going backwards\n");
+    printf("  -l: only measure the timer wakeup latency on every CPU\n");
+    printf("  -i: wakeup interval for -l, in us (default %d)\n",
+           LATENCY_INTERVAL_US);
+    printf("  -d: duration of -l, in seconds (default %d)\n",
+           LATENCY_SECONDS);
+    printf("  -p: run -l under SCHED_FIFO with this priority\n");
+    printf("  -M: largest latency allowed by -l, in us (default: no limit)\n");
+    printf("  -h: this help\n");
+}
+
+/* a number of at least `min` for option `what`, -1 if it isn't one */
+static long long parse_number(const char *name, const char *what,
+                              const char *arg, long long min)
+{
+    char *endptr;
+    long long value = strtoll(arg, &endptr, 0);
+    if (*endptr || endptr == arg || value < min) {
+        fprintf(stderr, "%s: error: bad %s \"%s\"\n", name, what, arg);
+        return -1;
+    }
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    int failures, opt, skew = 0, stress = 0, latency = 0;
+    long long max_skew = MAX_SKEW_NS;
+    long long interval = LATENCY_INTERVAL_US, seconds = LATENCY_SECONDS;
+    long long priority = 0, max_latency = 0;
+
+    while ((opt = getopt(argc, argv, "sm:cli:d:p:M:h")) != -1) {
+        switch (opt) {
+            case 's':
+                skew = 1;
+                break;
+            case 'm':
+                max_skew = parse_number(argv[0], "skew", optarg, 0);
+                if (max_skew < 0) return 1;
+                break;
+            case 'c':
+                stress = 1;
+                break;
+            case 'l':
+                latency = 1;
+                break;
+            case 'i':
+                interval = parse_number(argv[0], "interval", optarg, 1);
+                if (interval < 0) return 1;
+                break;
+            case 'd':
+                seconds = parse_number(argv[0], "duration", optarg, 1);
+                if (seconds < 0) return 1;
+                break;
+            case 'p':
+                priority = parse_number(argv[0], "priority", optarg, 1);
+                if (priority < 0) return 1;
+                if (priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "%s: error: bad priority \"%s\"\n",
+                            argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'M':
+                max_latency = parse_number(argv[0], "latency", optarg, 1);
+                if (max_latency < 0) return 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (latency)
+        return test_wakeup_latency(interval, seconds, priority, max_latency);
+
+    failures = skew ? test_clock_skew(max_skew) : test_clock_jitter();
+    if (failures == 0 && stress)
+        failures = test_clock_stress();
     if (failures == 0)
     {
-        failures = test_clock_direction();
+        failures = test_clock_drift();
     }
     return failures;
 }
+#endif
@@ -30,11 +30,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #ifdef __linux__
 #include <sys/sysinfo.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <signal.h>
 #define __USE_GNU 1
 #include <pthread.h>
@@ -50,39 +62,51 @@
 #define DEFAULT_RUNTIME 60*15
 #define DEFAULT_MEMPCT 0.95
 #define BARLEN 40
+#define CACHE_LINE 64
+#define PREFAULT_CHUNK (64UL<<20)
+#define MAX_COVERAGE 100
 
 /* configurable values used by the threads */
 int verbose = 0;
 int quiet = 0;
-int parallel = 0;
+int patterns = 0;
 unsigned num_threads, default_threads = DEFAULT_THREADS;
 unsigned runtime, default_runtime = DEFAULT_RUNTIME;
 unsigned long memsize, default_memsize;
+unsigned long mapsize; /* memory of each thread */
+unsigned long seed;
 /* system info */
 unsigned num_cpus;
 unsigned long total_ram;
 /* statistic gathering */
 struct timeval start={0,0}, finish={0,0}, duration={0,0};
-unsigned long *loop_counters = NULL;
+/* Results of each thread. They are updated on every loop, so every thread
+ * gets its own cache line; packed together they would bounce between the
+ * CPUs and slow down the very loops they count. */
+struct thread_stats {
+    atomic_ulong loops;      /* read by main() for -c while the test runs */
+    unsigned long verified_bytes;
+    unsigned long errors;
+    atomic_ulong prefaulted; /* bytes of the region faulted in so far */
+    atomic_ulong *reached;   /* -c: [n] pages this thread checked an nth time */
+    atomic_ulong epoch;      /* the random test moves it every EPOCH_LOOPS */
+} __attribute__((aligned(CACHE_LINE)));
+struct thread_stats *stats = NULL;
 /* pointers for threads and their memory regions */
 pthread_t *threads;
 char **mmap_regions = NULL;
-/* Thread mutexes and conditions */
-unsigned created_threads = 0;
-pthread_mutex_t ct_mutex = PTHREAD_MUTEX_INITIALIZER;
-unsigned live_threads = 0;
-pthread_mutex_t lt_mutex = PTHREAD_MUTEX_INITIALIZER;
-unsigned mmap_done = 0;
-pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t mmap_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t test_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t test_start = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t finish_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
-unsigned done = 0;
-unsigned running_threads = 0;
+unsigned long *region_pages = NULL;
+/* pages of each region still in the test, fewer than region_pages once
+ * it had to give memory back (see back_off()) */
+atomic_ulong *active_pages = NULL;
+unsigned long *region_pagesize = NULL;
+/* Thread synchronization. The flags are shared by all the threads (and
+ * the signal handler), so they are atomics. */
+atomic_uint live_threads = 0;
+/* all threads and main() meet here when the test starts, and the threads
+ * again before unmapping, since the others may still be reading */
+pthread_barrier_t start_barrier, finish_barrier;
+atomic_uint done = 0;
 /* short name of the program */
 char *basename = NULL;
 
@@ -98,6 +122,35 @@ int on_cpu(unsigned cpu){
     return 0;
 }
 
+/* Per-thread random numbers. rand() takes a process-wide lock, so with a
+ * thread or two per CPU the test ends up measuring contention on that lock
+ * rather than the memory. Each thread gets its own xorshift64* state,
+ * seeded with splitmix64 from the seed and its thread id, so a run can be
+ * reproduced with -s. */
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+uint64_t rng_seed(unsigned long thread_id) {
+    uint64_t x = seed ^ ((uint64_t)thread_id << 32);
+    uint64_t state = splitmix64(&x);
+    return state ? state : 1; /* an all-zero xorshift state stays zero */
+}
+static inline uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+/* a random number in [0, n), n < 2^32; multiply-shift instead of a divide */
+static inline unsigned long rng_below(uint64_t *state, unsigned long n) {
+    return (unsigned long)(((rng_next(state) >> 32) * (uint64_t)n) >> 32);
+}
+
 /* Parse a memsize string like '34m' or '128k' into a long int */
 long unsigned parse_memsize(const char *str) {
     long unsigned size;
@@ -129,6 +182,194 @@ char *human_memsize(long unsigned size) {
     return memsize_str;
 }
 
+/* NUMA placement. The topology comes from sysfs and regions are bound with
+ * the mbind syscall, so there's no need for libnuma. */
+#define MAX_NODES 1024
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+enum numa_mode { NUMA_NONE, NUMA_LOCAL, NUMA_REMOTE, NUMA_INTERLEAVE };
+const char *numa_mode_names[] = { "none", "local", "remote", "interleave" };
+enum numa_mode numa_mode = NUMA_NONE;
+unsigned num_nodes = 1;           /* highest node with memory + 1 */
+unsigned char mem_nodes[MAX_NODES] = { 1 };  /* nodes that have memory */
+int *cpu_node = NULL;             /* node of each CPU */
+int *region_node = NULL;          /* node of each region, -1 if spread */
+/* threads whose region the random test of a thread on node n may check */
+unsigned **node_targets = NULL;
+unsigned *node_ntargets = NULL;
+/* per node results of the random test, num_nodes counters per thread */
+unsigned long *node_loops = NULL;
+unsigned long *node_errors = NULL;
+
+/* Read a sysfs list like "0-3,8,10-11" and mark its members in set.
+ * Returns -1 if the file can't be read. */
+int read_sysfs_list(const char *path, unsigned char *set, unsigned max) {
+    char buf[4096], *s;
+    FILE *f = fopen(path,"r");
+    if (!f) return -1;
+    if (!fgets(buf,sizeof(buf),f)) buf[0]='\0';
+    fclose(f);
+    for (s=buf;*s && *s != '\n';) {
+        unsigned long lo, hi;
+        char *end;
+        lo = hi = strtoul(s,&end,10);
+        if (end == s) break;
+        if (*end == '-') hi = strtoul(end+1,&end,10);
+        for (;lo <= hi && lo < max;lo++) set[lo]=1;
+        s = *end == ',' ? end+1 : end;
+    }
+    return 0;
+}
+
+void detect_nodes(void) {
+    unsigned char *cpus = malloc(num_cpus);
+    char path[64];
+    unsigned node, cpu;
+    unsigned char has_memory[MAX_NODES] = { 0 };
+    cpu_node = calloc(num_cpus,sizeof(int));
+    /* without the file, all the memory is on node 0 */
+    if (read_sysfs_list("/sys/devices/system/node/has_memory",
+                        has_memory,MAX_NODES) == 0)
+        memcpy(mem_nodes,has_memory,sizeof(mem_nodes));
+    for (node=0;node<MAX_NODES;node++) {
+        if (mem_nodes[node]) num_nodes=node+1;
+        snprintf(path,sizeof(path),"/sys/devices/system/node/node%u/cpulist",node);
+        memset(cpus,0,num_cpus);
+        if (read_sysfs_list(path,cpus,num_cpus) != 0) continue;
+        for (cpu=0;cpu<num_cpus;cpu++)
+            if (cpus[cpu]) cpu_node[cpu]=node;
+    }
+    free(cpus);
+}
+
+/* nearest node after `node` that has memory, node itself if it's the only one */
+unsigned next_mem_node(unsigned node) {
+    unsigned i;
+    for (i=1;i<=num_nodes;i++) {
+        unsigned n = (node+i) % num_nodes;
+        if (mem_nodes[n] && n != node) return n;
+    }
+    return node;
+}
+
+/* The node of a CPU, or for CPUs of a node without memory (which may
+ * be past num_nodes) the nearest node with some */
+unsigned cpu_mem_node(unsigned cpu) {
+    unsigned n = cpu_node[cpu];
+    return mem_nodes[n] ? n : next_mem_node(n);
+}
+
+/* Where each thread's region goes, and which regions the random test of
+ * each node may read:
+ *   local:      regions on the node of their thread, reads stay on the node
+ *   remote:     regions on the node of their thread, reads only go to other
+ *               nodes; the pattern test puts the region on the next node
+ *   interleave: regions spread page by page over all nodes, reads anywhere */
+void plan_numa(void) {
+    unsigned t, n;
+    region_node = malloc(num_threads*sizeof(int));
+    for (t=0;t<num_threads;t++) {
+        n = cpu_mem_node(t % num_cpus);
+        if (numa_mode == NUMA_REMOTE && patterns) n = next_mem_node(n);
+        region_node[t] = numa_mode == NUMA_INTERLEAVE ? -1 : (int)n;
+    }
+    node_targets = calloc(num_nodes,sizeof(unsigned *));
+    node_ntargets = calloc(num_nodes,sizeof(unsigned));
+    for (n=0;n<num_nodes;n++) {
+        node_targets[n] = malloc(num_threads*sizeof(unsigned));
+        for (t=0;t<num_threads;t++) {
+            int same = region_node[t] == (int)n;
+            if (numa_mode == NUMA_INTERLEAVE ||
+                (numa_mode == NUMA_LOCAL && same) ||
+                (numa_mode == NUMA_REMOTE && !same))
+                node_targets[n][node_ntargets[n]++] = t;
+        }
+        /* a single node machine has nothing remote, and a node without
+         * memory nothing local; rather check something than nothing */
+        if (!node_ntargets[n]) {
+            for (t=0;t<num_threads;t++) node_targets[n][t] = t;
+            node_ntargets[n] = num_threads;
+        }
+    }
+    node_loops = calloc(num_threads*num_nodes,sizeof(unsigned long));
+    node_errors = calloc(num_threads*num_nodes,sizeof(unsigned long));
+}
+
+/* Apply the placement to a freshly mapped (not yet touched) region */
+void place_region(unsigned long thread_id, void *region, unsigned long size) {
+    unsigned long mask[MAX_NODES/(8*sizeof(unsigned long))];
+    unsigned n;
+    int policy = MPOL_BIND;
+    memset(mask,0,sizeof(mask));
+    if (region_node[thread_id] < 0) {
+        policy = MPOL_INTERLEAVE;
+        for (n=0;n<num_nodes;n++)
+            if (mem_nodes[n]) mask[n/(8*sizeof(unsigned long))] |= 1UL << (n % (8*sizeof(unsigned long)));
+    } else {
+        n = region_node[thread_id];
+        mask[n/(8*sizeof(unsigned long))] |= 1UL << (n % (8*sizeof(unsigned long)));
+    }
+    if (syscall(SYS_mbind,region,size,policy,mask,MAX_NODES+1,0) != 0)
+        perror("mbind");
+}
+
+/* Huge page backing for the regions. Explicit hugetlb pages have to be
+ * reserved by the admin (vm.nr_hugepages or hugepagesz=1G on the kernel
+ * command line); transparent huge pages only need THP to be enabled. */
+enum hugepage_mode { HUGE_NONE, HUGE_THP, HUGE_2M, HUGE_1G };
+const char *hugepage_mode_names[] = { "none", "thp", "2m", "1g" };
+enum hugepage_mode hugepages = HUGE_NONE;
+atomic_uint hugepage_fallbacks = 0;  /* threads that got normal pages instead */
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#define THP_SIZE (2UL<<20)
+
+/* Map *size bytes the way -H asks for, falling back to normal pages when
+ * huge ones can't be had. For hugetlb *size is rounded down to whole huge
+ * pages. *pagesize gets the size of the pages that carry the headers: the
+ * huge page size for hugetlb, the base page size otherwise since THP may
+ * still back parts of the region with small pages. */
+char *map_region(unsigned long *size, unsigned long *pagesize) {
+    char *region;
+    *pagesize = getpagesize();
+    if (hugepages == HUGE_2M || hugepages == HUGE_1G) {
+        unsigned shift = hugepages == HUGE_2M ? 21 : 30;
+        unsigned long huge = 1UL << shift, len = *size & ~(huge-1);
+        if (len) {
+            region = mmap(NULL,len,PROT_READ|PROT_WRITE,
+                          MAP_ANONYMOUS|MAP_PRIVATE|MAP_HUGETLB|
+                          (shift << MAP_HUGE_SHIFT),-1,0);
+            if (region != MAP_FAILED) {
+                *size = len;
+                *pagesize = huge;
+                return region;
+            }
+        }
+        atomic_fetch_add(&hugepage_fallbacks,1);
+    } else if (hugepages == HUGE_THP) {
+        /* a huge page can only back a whole, aligned 2M, so map a bit more
+         * than needed and trim it to an aligned start */
+        unsigned long len = *size + THP_SIZE;
+        char *raw, *tail;
+        raw = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_ANONYMOUS|MAP_PRIVATE,-1,0);
+        if (raw == MAP_FAILED) return raw;
+        region = (char *)(((uintptr_t)raw + THP_SIZE-1) & ~(THP_SIZE-1));
+        tail = (char *)(((uintptr_t)region + *size + *pagesize-1) & ~(*pagesize-1));
+        if (region > raw) munmap(raw,region-raw);
+        if (tail < raw+len) munmap(tail,raw+len-tail);
+        if (madvise(region,*size,MADV_HUGEPAGE) != 0)
+            atomic_fetch_add(&hugepage_fallbacks,1);
+        return region;
+    }
+    return mmap(NULL,*size,PROT_READ|PROT_WRITE,MAP_ANONYMOUS|MAP_PRIVATE,-1,0);
+}
+
 /* A cute little progress bar */
 void progressbar(char *label, unsigned cur, unsigned total) {
     unsigned pos;
@@ -143,104 +384,1091 @@ void progressbar(char *label, unsigned cur, unsigned total) {
     fflush(stdout);
 }
 
-/* This is the function that the threads run */
-void *mem_twiddler(void *arg) {
-    unsigned long thread_id, pages, pagesize, i, p;
-    volatile long garbage;
-    long *lp;
-    int t,offset;
-    char *my_region;
-    unsigned long mapsize = *(unsigned long *)arg;
+/* Pattern test kernels. Every kernel works on a span of 64-bit words, which
+ * doesn't have to be vector aligned. The fills use non-temporal stores where
+ * the ISA has them, so the verify pass that follows reads the pattern back
+ * from RAM instead of from the cache. compare() returns the index of the
+ * first word that doesn't match, or `words` if they all do. The _addr
+ * variants expect every word to hold its own address XORed with `pattern`. */
+struct pattern_kernels {
+    const char *name;
+    void (*fill)(uint64_t *p, size_t words, uint64_t pattern);
+    size_t (*compare)(const uint64_t *p, size_t words, uint64_t pattern);
+    void (*fill_addr)(uint64_t *p, size_t words, uint64_t pattern);
+    size_t (*compare_addr)(const uint64_t *p, size_t words, uint64_t pattern);
+};
+
+static void fill_scalar(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i;
+    for (i=0;i<words;i++) p[i]=pattern;
+}
+static size_t compare_scalar(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i;
+    for (i=0;i<words;i++)
+        if (p[i] != pattern) return i;
+    return words;
+}
+static void fill_addr_scalar(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i;
+    for (i=0;i<words;i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+}
+static size_t compare_addr_scalar(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i;
+    for (i=0;i<words;i++)
+        if (p[i] != ((uint64_t)(uintptr_t)&p[i] ^ pattern)) return i;
+    return words;
+}
 
-    /* Make sure each thread gets a unique ID */
-    pthread_mutex_lock(&ct_mutex);
-    thread_id=created_threads++;
-    pthread_mutex_unlock(&ct_mutex);
-    if (parallel) {
-        /* let main() go as soon as the thread is created */
-        mmap_done=1;
-        pthread_cond_signal(&mmap_cond);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void fill_avx2(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m256i v=_mm256_set1_epi64x(pattern);
+    for (;i<words && ((uintptr_t)&p[i] & 31);i++) p[i]=pattern;
+    for (;i+4<=words;i+=4) _mm256_stream_si256((__m256i *)&p[i],v);
+    for (;i<words;i++) p[i]=pattern;
+    _mm_sfence();
+}
+__attribute__((target("avx2")))
+static size_t compare_avx2(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m256i v=_mm256_set1_epi64x(pattern);
+    /* 128 bytes per iteration, the scalar tail finds the exact word */
+    for (;i+16<=words;i+=16) {
+        __m256i d0=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[i]),v);
+        __m256i d1=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[i+4]),v);
+        __m256i d2=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[i+8]),v);
+        __m256i d3=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[i+12]),v);
+        __m256i d=_mm256_or_si256(_mm256_or_si256(d0,d1),_mm256_or_si256(d2,d3));
+        if (!_mm256_testz_si256(d,d)) break;
     }
+    return i+compare_scalar(p+i,words-i,pattern);
+}
+__attribute__((target("avx2")))
+static void fill_addr_avx2(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m256i mask=_mm256_set1_epi64x(pattern), step=_mm256_set1_epi64x(32), addr;
+    for (;i<words && ((uintptr_t)&p[i] & 31);i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+    addr=_mm256_setr_epi64x((uintptr_t)&p[i],(uintptr_t)&p[i]+8,
+                            (uintptr_t)&p[i]+16,(uintptr_t)&p[i]+24);
+    for (;i+4<=words;i+=4) {
+        _mm256_stream_si256((__m256i *)&p[i],_mm256_xor_si256(addr,mask));
+        addr=_mm256_add_epi64(addr,step);
+    }
+    for (;i<words;i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+    _mm_sfence();
+}
+__attribute__((target("avx2")))
+static size_t compare_addr_avx2(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m256i mask=_mm256_set1_epi64x(pattern), step=_mm256_set1_epi64x(32);
+    __m256i addr=_mm256_setr_epi64x((uintptr_t)p,(uintptr_t)p+8,
+                                    (uintptr_t)p+16,(uintptr_t)p+24);
+    for (;i+4<=words;i+=4) {
+        __m256i d=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[i]),
+                                   _mm256_xor_si256(addr,mask));
+        if (!_mm256_testz_si256(d,d)) break;
+        addr=_mm256_add_epi64(addr,step);
+    }
+    return i+compare_addr_scalar(p+i,words-i,pattern);
+}
 
-    on_cpu(thread_id % num_cpus);
-    pagesize=getpagesize();
-    pages=mapsize/pagesize;
+__attribute__((target("avx512f")))
+static void fill_avx512(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m512i v=_mm512_set1_epi64(pattern);
+    for (;i<words && ((uintptr_t)&p[i] & 63);i++) p[i]=pattern;
+    for (;i+8<=words;i+=8) _mm512_stream_si512((void *)&p[i],v);
+    for (;i<words;i++) p[i]=pattern;
+    _mm_sfence();
+}
+__attribute__((target("avx512f")))
+static size_t compare_avx512(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m512i v=_mm512_set1_epi64(pattern);
+    for (;i+32<=words;i+=32) {
+        __mmask8 m=_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&p[i]),v)
+                  |_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&p[i+8]),v)
+                  |_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&p[i+16]),v)
+                  |_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&p[i+24]),v);
+        if (m) break;
+    }
+    return i+compare_scalar(p+i,words-i,pattern);
+}
+__attribute__((target("avx512f")))
+static void fill_addr_avx512(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m512i mask=_mm512_set1_epi64(pattern), step=_mm512_set1_epi64(64), addr;
+    for (;i<words && ((uintptr_t)&p[i] & 63);i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+    addr=_mm512_add_epi64(_mm512_set1_epi64((uintptr_t)&p[i]),
+                          _mm512_setr_epi64(0,8,16,24,32,40,48,56));
+    for (;i+8<=words;i+=8) {
+        _mm512_stream_si512((void *)&p[i],_mm512_xor_si512(addr,mask));
+        addr=_mm512_add_epi64(addr,step);
+    }
+    for (;i<words;i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+    _mm_sfence();
+}
+__attribute__((target("avx512f")))
+static size_t compare_addr_avx512(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    __m512i mask=_mm512_set1_epi64(pattern), step=_mm512_set1_epi64(64);
+    __m512i addr=_mm512_add_epi64(_mm512_set1_epi64((uintptr_t)p),
+                                  _mm512_setr_epi64(0,8,16,24,32,40,48,56));
+    for (;i+8<=words;i+=8) {
+        if (_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&p[i]),
+                                     _mm512_xor_si512(addr,mask)))
+            break;
+        addr=_mm512_add_epi64(addr,step);
+    }
+    return i+compare_addr_scalar(p+i,words-i,pattern);
+}
+#endif /* x86 */
 
-    /* Map a chunk of memory */
-    if (verbose) printf("thread %ld: mapping %s RAM\n",
-                        thread_id,human_memsize(mapsize));
-    my_region=mmap(NULL,mapsize,PROT_READ|PROT_WRITE,
-                   MAP_ANONYMOUS|MAP_PRIVATE,-1,0);
-    if (my_region == MAP_FAILED) { perror("mmap"); exit(1); }
-    mmap_regions[thread_id] = my_region;
-    /* Dirty each page of the mem region to fault them into existence */
-    for (i=0;i<pages;i++) {
-        lp=(long *)&(my_region[i*pagesize]);
-        lp[0]=0xDEADBEEF; /* magic number */
-        lp[1]=thread_id;
-        lp[2]=i;
+#if defined(__aarch64__)
+/* NEON has no non-temporal stores, these are plain vector stores */
+static void fill_neon(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    uint64x2_t v=vdupq_n_u64(pattern);
+    for (;i+8<=words;i+=8) {
+        vst1q_u64(&p[i],v); vst1q_u64(&p[i+2],v);
+        vst1q_u64(&p[i+4],v); vst1q_u64(&p[i+6],v);
     }
-    /* Okay, we have grabbed our memory - this thread is now live */
-    pthread_mutex_lock(&lt_mutex);
-    live_threads++;
-    pthread_mutex_unlock(&lt_mutex);
-    if (verbose) printf("thread %ld: mapping complete\n",thread_id);
+    for (;i<words;i++) p[i]=pattern;
+}
+static size_t compare_neon(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    uint64x2_t v=vdupq_n_u64(pattern);
+    for (;i+8<=words;i+=8) {
+        uint64x2_t d=vorrq_u64(
+            vorrq_u64(veorq_u64(vld1q_u64(&p[i]),v),veorq_u64(vld1q_u64(&p[i+2]),v)),
+            vorrq_u64(veorq_u64(vld1q_u64(&p[i+4]),v),veorq_u64(vld1q_u64(&p[i+6]),v)));
+        if (vmaxvq_u32(vreinterpretq_u32_u64(d))) break;
+    }
+    return i+compare_scalar(p+i,words-i,pattern);
+}
+static void fill_addr_neon(uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    uint64x2_t mask=vdupq_n_u64(pattern), step=vdupq_n_u64(16);
+    uint64x2_t addr=vcombine_u64(vcreate_u64((uintptr_t)p),vcreate_u64((uintptr_t)p+8));
+    for (;i+2<=words;i+=2) {
+        vst1q_u64(&p[i],veorq_u64(addr,mask));
+        addr=vaddq_u64(addr,step);
+    }
+    for (;i<words;i++) p[i]=(uint64_t)(uintptr_t)&p[i] ^ pattern;
+}
+static size_t compare_addr_neon(const uint64_t *p, size_t words, uint64_t pattern) {
+    size_t i=0;
+    uint64x2_t mask=vdupq_n_u64(pattern), step=vdupq_n_u64(16);
+    uint64x2_t addr=vcombine_u64(vcreate_u64((uintptr_t)p),vcreate_u64((uintptr_t)p+8));
+    for (;i+2<=words;i+=2) {
+        uint64x2_t d=veorq_u64(vld1q_u64(&p[i]),veorq_u64(addr,mask));
+        if (vmaxvq_u32(vreinterpretq_u32_u64(d))) break;
+        addr=vaddq_u64(addr,step);
+    }
+    return i+compare_addr_scalar(p+i,words-i,pattern);
+}
+#endif /* __aarch64__ */
+
+struct pattern_kernels kernels = {
+    "scalar",fill_scalar,compare_scalar,fill_addr_scalar,compare_addr_scalar
+};
+
+/* pick the widest kernels the CPU we're running on supports */
+void select_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct pattern_kernels avx2 = {
+        "avx2",fill_avx2,compare_avx2,fill_addr_avx2,compare_addr_avx2
+    };
+    struct pattern_kernels avx512 = {
+        "avx512",fill_avx512,compare_avx512,fill_addr_avx512,compare_addr_avx512
+    };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) kernels=avx512;
+    else if (__builtin_cpu_supports("avx2")) kernels=avx2;
+#elif defined(__aarch64__)
+    struct pattern_kernels neon = {
+        "neon",fill_neon,compare_neon,fill_addr_neon,compare_addr_neon
+    };
+    kernels=neon;
+#endif
+}
+
+/* Words are filled and checked this many at a time, so the end of the
+ * test is noticed in the middle of a pass too */
+#define CHUNK_WORDS (1UL<<17)
+
+/* Error reporting. A failing DIMM can produce millions of bad reads, so
+ * they aren't printed one by one. Each thread keeps its findings in its own
+ * ring (nothing is shared, nothing is locked), folding repeats of the same
+ * word into one record, and prints at most ERROR_PRINTS_PER_SEC of them
+ * as they happen. main() merges the rings into a summary at the end. */
+#define ERROR_RING 256
+#define ERROR_PRINTS_PER_SEC 5
+#define ERROR_SUMMARY_MAX 32
+struct error_record {
+    unsigned region;          /* thread owning the memory */
+    unsigned long offset;     /* of the word in the region */
+    const void *vaddr;
+    unsigned long long paddr; /* ~0 if unknown */
+    uint64_t read, expected;  /* of the first bad read */
+    uint64_t flipped;         /* bits seen wrong in any of the reads */
+    unsigned long count;
+    unsigned long thread;     /* first thread to see it */
+};
+struct error_ring {
+    struct error_record rec[ERROR_RING];
+    unsigned used, next;      /* records in use, next one to replace */
+    unsigned long dropped;    /* records pushed out of a full ring */
+    unsigned long suppressed; /* errors seen but not printed */
+    time_t second;            /* rate limit of the printing */
+    unsigned printed;
+} __attribute__((aligned(CACHE_LINE)));
+struct error_ring *error_rings = NULL;
+int pagemap_fd = -1;
 
-    /* let main() go now that the thread is finished initializing. */
-    if (!parallel) {
-        mmap_done=1;
-        pthread_cond_signal(&mmap_cond);
-    } else if (live_threads == num_threads) {
-        /* if this is the last thread to init, let main() know we're done */
-        pthread_cond_signal(&init_cond);
+/* Physical address of a virtual one through /proc/self/pagemap, ~0 if
+ * that's not possible: since Linux 4.0 the frame numbers read as 0 without
+ * CAP_SYS_ADMIN. */
+unsigned long long physical_address(const void *vaddr) {
+    unsigned long pagesize = sysconf(_SC_PAGESIZE);
+    uint64_t entry;
+    off_t pos = (uintptr_t)vaddr/pagesize*sizeof(entry);
+    if (pagemap_fd < 0 ||
+        pread(pagemap_fd,&entry,sizeof(entry),pos) != sizeof(entry))
+        return ~0ULL;
+    /* bit 63: present, bits 0-54: frame number */
+    if (!(entry & (1ULL<<63)) || !(entry & ((1ULL<<55)-1)))
+        return ~0ULL;
+    return (entry & ((1ULL<<55)-1))*pagesize + (uintptr_t)vaddr % pagesize;
+}
+
+void format_paddr(char *buf, size_t len, unsigned long long paddr) {
+    if (paddr == ~0ULL) snprintf(buf,len,"unknown");
+    else snprintf(buf,len,"%#llx",paddr);
+}
+
+/* Record that the word at `offset` of `region` read as `read` rather than
+ * `expected` */
+void report_error(unsigned long thread_id, unsigned region,
+                  unsigned long offset, uint64_t read, uint64_t expected) {
+    struct error_ring *ring = &error_rings[thread_id];
+    struct error_record *rec = NULL;
+    unsigned i;
+    time_t now;
+    char paddr[32];
+    stats[thread_id].errors++;
+    for (i=0;i<ring->used;i++) {
+        if (ring->rec[i].region == region && ring->rec[i].offset == offset) {
+            rec = &ring->rec[i];
+            break;
+        }
+    }
+    if (rec) {
+        rec->count++;
+        rec->flipped |= read ^ expected;
+        return; /* already reported */
+    }
+    if (ring->used < ERROR_RING) {
+        rec = &ring->rec[ring->used++];
+    } else {
+        rec = &ring->rec[ring->next];
+        ring->next = (ring->next+1) % ERROR_RING;
+        ring->dropped++;
+    }
+    rec->region = region;
+    rec->offset = offset;
+    rec->vaddr = &mmap_regions[region][offset];
+    rec->paddr = physical_address(rec->vaddr);
+    rec->read = read;
+    rec->expected = expected;
+    rec->flipped = read ^ expected;
+    rec->count = 1;
+    rec->thread = thread_id;
+    now = time(NULL);
+    if (now != ring->second) {
+        ring->second = now;
+        ring->printed = 0;
     }
+    if (ring->printed >= ERROR_PRINTS_PER_SEC) {
+        ring->suppressed++;
+        return;
+    }
+    ring->printed++;
+    format_paddr(paddr,sizeof(paddr),rec->paddr);
+    fprintf(stderr,"MEMORY CORRUPTION DETECTED: thread %lu (CPU %lu) "
+            "region %u offset %#lx (%p, physical %s) read: %#llx "
+            "should be: %#llx\n",thread_id,thread_id % num_cpus,region,
+            offset,rec->vaddr,paddr,(unsigned long long)read,
+            (unsigned long long)expected);
+}
 
-    /* Wait for the signal to begin testing */
-    pthread_mutex_lock(&test_mutex);
-    while (start.tv_sec == 0) {
-        pthread_cond_wait(&test_start,&test_mutex);
+int compare_records(const void *a, const void *b) {
+    const struct error_record *x = a, *y = b;
+    if (x->region != y->region) return x->region < y->region ? -1 : 1;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+int compare_counts(const void *a, const void *b) {
+    const struct error_record *x = a, *y = b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return compare_records(a,b);
+}
+
+/* Merge the rings of all the threads (the random test has every thread
+ * read every region, so they see the same words) and print the summary,
+ * worst addresses first. */
+void print_error_summary(void) {
+    struct error_record *all;
+    unsigned long total=0, dropped=0, suppressed=0, pages=0;
+    unsigned long long last_page=~0ULL;
+    uint64_t flipped=0;
+    unsigned n=0, m, t, i;
+    char paddr[32];
+    for (t=0;t<num_threads;t++) {
+        total += stats[t].errors;
+        dropped += error_rings[t].dropped;
+        suppressed += error_rings[t].suppressed;
+        n += error_rings[t].used;
     }
-    running_threads++;
-    pthread_mutex_unlock(&test_mutex);
-    if (verbose) printf("thread %lu: test start\n",thread_id);
+    if (!total) return;
+    all = malloc(n*sizeof(*all));
+    if (!all) { perror("malloc"); return; }
+    for (n=0,t=0;t<num_threads;t++) {
+        memcpy(&all[n],error_rings[t].rec,
+               error_rings[t].used*sizeof(*all));
+        n += error_rings[t].used;
+    }
+    qsort(all,n,sizeof(*all),compare_records);
+    for (m=0,i=0;i<n;i++) {
+        if (m && !compare_records(&all[m-1],&all[i])) {
+            all[m-1].count += all[i].count;
+            all[m-1].flipped |= all[i].flipped;
+            continue;
+        }
+        all[m++] = all[i];
+    }
+    for (i=0;i<m;i++) {
+        unsigned long long page = ((unsigned long long)all[i].region<<40) +
+            all[i].offset/region_pagesize[all[i].region];
+        if (page != last_page) pages++;
+        last_page = page;
+        flipped |= all[i].flipped;
+    }
+    qsort(all,m,sizeof(*all),compare_counts);
+    printf("Error summary:\n");
+    printf("  %lu errors at %u addresses in %lu pages",total,m,pages);
+    if (dropped) printf(" (and more addresses not kept)");
+    printf("\n  bits in error: %#llx\n",(unsigned long long)flipped);
+    if (suppressed)
+        printf("  %lu reports were not printed\n",suppressed);
+    for (i=0;i<m && i<ERROR_SUMMARY_MAX;i++) {
+        format_paddr(paddr,sizeof(paddr),all[i].paddr);
+        printf("  region %u offset %#lx physical %s: %lu times, "
+               "read %#llx should be %#llx, bits %#llx, first by thread %lu\n",
+               all[i].region,all[i].offset,paddr,all[i].count,
+               (unsigned long long)all[i].read,
+               (unsigned long long)all[i].expected,
+               (unsigned long long)all[i].flipped,all[i].thread);
+    }
+    if (m > ERROR_SUMMARY_MAX)
+        printf("  ... %u more addresses\n",m-ERROR_SUMMARY_MAX);
+    if (m && all[0].paddr == ~0ULL)
+        printf("  (physical addresses need CAP_SYS_ADMIN)\n");
+    free(all);
+}
+
+void pattern_error(unsigned long thread_id, const uint64_t *p,
+                   uint64_t expected) {
+    report_error(thread_id,thread_id,
+                 (const char *)p-mmap_regions[thread_id],*p,expected);
+}
+
+/* Check `words` words against `pattern` (against their address XORed with
+ * `pattern` if addr is set), report and count the bad ones */
+void verify_words(unsigned long thread_id, const uint64_t *p, size_t words,
+                  uint64_t pattern, int addr) {
+    size_t i=0;
+    for (;;) {
+        i += addr ? kernels.compare_addr(p+i,words-i,pattern) :
+                    kernels.compare(p+i,words-i,pattern);
+        if (i >= words) break;
+        pattern_error(thread_id,&p[i],
+                      addr ? (uint64_t)(uintptr_t)&p[i] ^ pattern : pattern);
+        i++;
+    }
+    stats[thread_id].verified_bytes += words*sizeof(uint64_t);
+}
+
+/* Fill the whole region, then verify all of it */
+void fill_and_verify(unsigned long thread_id, uint64_t *p, size_t words,
+                     uint64_t pattern, int addr) {
+    size_t off;
+    for (off=0;off<words && !done;off+=CHUNK_WORDS) {
+        size_t n = words-off < CHUNK_WORDS ? words-off : CHUNK_WORDS;
+        if (addr) kernels.fill_addr(p+off,n,pattern);
+        else kernels.fill(p+off,n,pattern);
+    }
+    for (off=0;off<words && !done;off+=CHUNK_WORDS) {
+        size_t n = words-off < CHUNK_WORDS ? words-off : CHUNK_WORDS;
+        verify_words(thread_id,p+off,n,pattern,addr);
+    }
+}
 
-    loop_counters[thread_id]=0;
-    while (!done) {
+/* Moving inversions, a chunk at a time: fill with the pattern, then going
+ * up check each chunk and write its inverse, then going down check the
+ * inverse and write the pattern back. Catches coupling faults between
+ * cells that a plain fill and verify can't. */
+void moving_inversions(unsigned long thread_id, uint64_t *p, size_t words,
+                       uint64_t pattern) {
+    size_t off, chunks = (words+CHUNK_WORDS-1)/CHUNK_WORDS;
+    for (off=0;off<words && !done;off+=CHUNK_WORDS) {
+        size_t n = words-off < CHUNK_WORDS ? words-off : CHUNK_WORDS;
+        kernels.fill(p+off,n,pattern);
+    }
+    for (off=0;off<words && !done;off+=CHUNK_WORDS) {
+        size_t n = words-off < CHUNK_WORDS ? words-off : CHUNK_WORDS;
+        verify_words(thread_id,p+off,n,pattern,0);
+        kernels.fill(p+off,n,~pattern);
+    }
+    while (chunks-- > 0 && !done) {
+        size_t n;
+        off = chunks*CHUNK_WORDS;
+        n = words-off < CHUNK_WORDS ? words-off : CHUNK_WORDS;
+        verify_words(thread_id,p+off,n,~pattern,0);
+        kernels.fill(p+off,n,pattern);
+    }
+}
+
+/* Fill with a pseudo-random stream, then regenerate it to verify */
+void random_verify(unsigned long thread_id, uint64_t *p, size_t words,
+                   uint64_t *rng) {
+    uint64_t state, start = rng_next(rng) | 1;
+    size_t i;
+    state = start;
+    for (i=0;i<words && !(i % CHUNK_WORDS == 0 && done);i++)
+        p[i] = rng_next(&state);
+    words = i;
+    state = start;
+    for (i=0;i<words;i++) {
+        uint64_t expected = rng_next(&state);
+        if (p[i] != expected)
+            pattern_error(thread_id,&p[i],expected);
+    }
+    stats[thread_id].verified_bytes += words*sizeof(uint64_t);
+}
+
+/* The pattern test's side of back_off(): the words of its region still in
+ * the test, giving back any pages past them */
+size_t trim_region(unsigned long thread_id, char *region, size_t words) {
+    size_t active = atomic_load_explicit(&active_pages[thread_id],memory_order_relaxed)
+                    *region_pagesize[thread_id]/sizeof(uint64_t);
+    if (active >= words) return words;
+    madvise(region+active*sizeof(uint64_t),(words-active)*sizeof(uint64_t),
+            MADV_DONTNEED);
+    return active;
+}
+
+/* Sequential pattern passes over the thread's own region until the test is
+ * over. Each round goes through all the patterns, the walking bit moves by
+ * one every round. */
+void pattern_test(unsigned long thread_id, char *region, unsigned long size,
+                  uint64_t *rng) {
+    uint64_t *p = (uint64_t *)region;
+    size_t words = size/sizeof(uint64_t);
+    unsigned long round;
+    for (round=0;!done;round++) {
+        uint64_t bit = 1ULL << (round % 64);
+        words = trim_region(thread_id,region,words);
+        fill_and_verify(thread_id,p,words,bit,0);          /* walking ones */
+        words = trim_region(thread_id,region,words);
+        fill_and_verify(thread_id,p,words,~bit,0);         /* walking zeros */
+        words = trim_region(thread_id,region,words);
+        moving_inversions(thread_id,p,words,rng_next(rng));
+        words = trim_region(thread_id,region,words);
+        fill_and_verify(thread_id,p,words,                 /* address in address */
+                        round % 2 ? ~0ULL : 0,1);
+        words = trim_region(thread_id,region,words);
+        random_verify(thread_id,p,words,rng);
+        if (!done) atomic_fetch_add(&stats[thread_id].loops,1);
+    }
+}
+
+/* Benchmark mode (-B): STREAM-like bandwidth of the thread's own region and
+ * pointer chasing latency for working sets sized after the caches. All the
+ * threads run every step at the same time, so the totals are what the
+ * memory delivers under full load. */
+#define BENCH_REPS 5
+enum { BENCH_WRITE, BENCH_READ, BENCH_COPY, BENCH_KERNELS };
+const char *bench_names[BENCH_KERNELS] = { "write", "read", "copy" };
+#define LAT_LEVELS 4
+const char *lat_names[LAT_LEVELS] = { "L1", "L2", "LLC", "DRAM" };
+/* histogram of the average load latency of each batch of loads, bucket b
+ * counts batches under 2^b ns, the last one everything slower */
+#define LAT_BUCKETS 12
+#define LAT_BATCH 4096
+struct bench_result {
+    double seconds[BENCH_KERNELS][BENCH_REPS];
+    unsigned long bytes[BENCH_KERNELS];
+    double latency_ns[LAT_LEVELS];
+    unsigned long hist[LAT_LEVELS][LAT_BUCKETS];
+};
+struct bench_result *bench = NULL;
+unsigned long lat_size[LAT_LEVELS]; /* 0 if the region is too small */
+pthread_barrier_t bench_barrier;
+int benchmark = 0;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Working set sizes: half of each cache level, so the chain stays inside
+ * it, and for DRAM well beyond the last level cache. `region` is the size
+ * of the smallest region, as mapped. */
+void plan_latency(unsigned long region) {
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    unsigned i;
+    if (l1 <= 0) l1 = 32L<<10;
+    if (l2 <= 0) l2 = 1L<<20;
+    if (l3 <= 0) l3 = 8L<<20;
+    lat_size[0] = l1/2;
+    lat_size[1] = l2/2;
+    lat_size[2] = l3/2;
+    lat_size[3] = 8*l3 > (256L<<20) ? 8*l3 : (256L<<20);
+    for (i=0;i<LAT_LEVELS;i++)
+        if (lat_size[i] > region) lat_size[i] = i == LAT_LEVELS-1 ? region : 0;
+    /* a "DRAM" set that fits in the LLC wouldn't measure DRAM */
+    if (lat_size[3] <= (unsigned long)l3) lat_size[3] = 0;
+}
+
+/* Random cyclic chain through the cache lines of the first `size` bytes
+ * (Sattolo's shuffle, so it's a single cycle the prefetchers can't guess),
+ * followed for about 100ms. Returns the average ns per load. */
+double chase(char *region, unsigned long size, uint64_t *rng,
+             unsigned long *hist) {
+    unsigned long lines = size/CACHE_LINE, i, loads = 0;
+    unsigned *perm = malloc(lines*sizeof(unsigned));
+    double begin, end;
+    void **p;
+    if (!perm || lines < 2) { free(perm); return 0; }
+    for (i=0;i<lines;i++) perm[i]=i;
+    for (i=lines-1;i>0;i--) {
+        unsigned long j = rng_below(rng,i);
+        unsigned tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
+    }
+    for (i=0;i<lines;i++)
+        *(void **)&region[i*CACHE_LINE] = &region[perm[i]*CACHE_LINE];
+    free(perm);
+    p = (void **)region;
+    begin = end = now_seconds();
+    while (end-begin < 0.1 || loads < 16*LAT_BATCH) {
+        double batch_start = end, ns;
+        unsigned b;
+        for (i=0;i<LAT_BATCH;i+=8) {
+            p=*p; p=*p; p=*p; p=*p; p=*p; p=*p; p=*p; p=*p;
+        }
+        end = now_seconds();
+        loads += LAT_BATCH;
+        ns = (end-batch_start)*1e9/LAT_BATCH;
+        for (b=0;b<LAT_BUCKETS-1 && ns >= (double)(1UL<<b);b++);
+        hist[b]++;
+    }
+    /* keep the compiler from dropping the chase */
+    if (p == NULL) printf("%p\n",(void *)p);
+    return (end-begin)*1e9/loads;
+}
+
+void run_benchmark(unsigned long thread_id, char *region, unsigned long size,
+                   uint64_t *rng) {
+    struct bench_result *res = &bench[thread_id];
+    uint64_t *p = (uint64_t *)region;
+    size_t words = size/sizeof(uint64_t), half = words/2;
+    unsigned k, rep, level;
+    res->bytes[BENCH_WRITE] = words*sizeof(uint64_t);
+    res->bytes[BENCH_READ] = words*sizeof(uint64_t);
+    /* STREAM counts both the read and the write of a copy */
+    res->bytes[BENCH_COPY] = 2*half*sizeof(uint64_t);
+    for (k=0;k<BENCH_KERNELS;k++) {
+        for (rep=0;rep<BENCH_REPS;rep++) {
+            double t0;
+            pthread_barrier_wait(&bench_barrier);
+            t0 = now_seconds();
+            switch (k) {
+                case BENCH_WRITE: kernels.fill(p,words,rep); break;
+                /* the region holds the pattern of the last write */
+                case BENCH_READ:
+                    if (kernels.compare(p,words,BENCH_REPS-1) != words)
+                        stats[thread_id].errors++;
+                    break;
+                case BENCH_COPY: memcpy(p+half,p,half*sizeof(uint64_t)); break;
+            }
+            res->seconds[k][rep] = now_seconds()-t0;
+        }
+    }
+    for (level=0;level<LAT_LEVELS;level++) {
+        pthread_barrier_wait(&bench_barrier);
+        if (lat_size[level])
+            res->latency_ns[level] = chase(region,lat_size[level],rng,
+                                           res->hist[level]);
+    }
+}
+
+void print_histogram(const char *key, const unsigned long *hist) {
+    unsigned b;
+    printf("%s:",key);
+    for (b=0;b<LAT_BUCKETS-1;b++) printf(" <%lu:%lu",1UL<<b,hist[b]);
+    printf(" >=%lu:%lu\n",1UL<<(LAT_BUCKETS-1),hist[LAT_BUCKETS-1]);
+}
+
+/* Everything as "key: value" lines, for memory_test.py. Bandwidths are in
+ * MB/s (10^6 bytes) of the best of BENCH_REPS runs, latencies in ns. */
+void print_benchmark(void) {
+    unsigned t, k, rep, level, b;
+    char key[64];
+    printf("bench_threads: %u\n",num_threads);
+    for (k=0;k<BENCH_KERNELS;k++) {
+        /* totals: all the bytes over the slowest thread of each run */
+        double best = 0;
+        for (rep=0;rep<BENCH_REPS;rep++) {
+            double bytes = 0, slowest = 0;
+            for (t=0;t<num_threads;t++) {
+                bytes += bench[t].bytes[k];
+                if (bench[t].seconds[k][rep] > slowest)
+                    slowest = bench[t].seconds[k][rep];
+            }
+            if (slowest > 0 && bytes/slowest > best) best = bytes/slowest;
+        }
+        printf("%s_MBps: %.1f\n",bench_names[k],best/1e6);
+    }
+    for (level=0;level<LAT_LEVELS;level++) {
+        unsigned long hist[LAT_BUCKETS] = { 0 };
+        double sum = 0;
+        if (!lat_size[level]) continue;
+        for (t=0;t<num_threads;t++) {
+            sum += bench[t].latency_ns[level];
+            for (b=0;b<LAT_BUCKETS;b++) hist[b] += bench[t].hist[level][b];
+        }
+        printf("latency_%s_bytes: %lu\n",lat_names[level],lat_size[level]);
+        printf("latency_%s_ns: %.2f\n",lat_names[level],sum/num_threads);
+        snprintf(key,sizeof(key),"latency_%s_hist",lat_names[level]);
+        print_histogram(key,hist);
+    }
+    for (t=0;t<num_threads;t++) {
+        for (k=0;k<BENCH_KERNELS;k++) {
+            double fastest = 0;
+            for (rep=0;rep<BENCH_REPS;rep++)
+                if (!fastest || bench[t].seconds[k][rep] < fastest)
+                    fastest = bench[t].seconds[k][rep];
+            printf("thread_%u_%s_MBps: %.1f\n",t,bench_names[k],
+                   fastest > 0 ? bench[t].bytes[k]/fastest/1e6 : 0.0);
+        }
+        for (level=0;level<LAT_LEVELS;level++) {
+            if (!lat_size[level]) continue;
+            printf("thread_%u_latency_%s_ns: %.2f\n",t,lat_names[level],
+                   bench[t].latency_ns[level]);
+            snprintf(key,sizeof(key),"thread_%u_latency_%s_hist",t,lat_names[level]);
+            print_histogram(key,bench[t].hist[level]);
+        }
+    }
+}
+
+/* Coverage (-c): instead of running for -t seconds, stop once the memory
+ * has been covered `coverage_target` times, with -t as a time cap. A
+ * pattern test round writes and verifies every byte of the thread's
+ * region, so the passes there are the rounds of the slowest thread. The
+ * random test only verifies the three header words of each page, the word
+ * it then reads or writes is never checked; its passes are header checks.
+ * It counts how many times each page had its header checked, a byte per
+ * page, and the pages reaching each count; a pass is complete when every
+ * page of every region has reached it. */
+unsigned coverage_target = 0;
+atomic_uchar **page_checks = NULL;  /* [region][page] */
+unsigned long total_pages = 0;
+/* the pages given back under memory pressure that had reached each count */
+unsigned long *coverage_adjust = NULL;
+
+static inline void count_check(unsigned long thread_id, unsigned region,
+                               unsigned long page) {
+    atomic_uchar *checks = &page_checks[region][page];
+    unsigned n = atomic_load_explicit(checks,memory_order_relaxed);
+    /* once a page is at the target, which soon is most of them, the
+     * counters are only read, and their cache lines stay shared */
+    if (n >= coverage_target) return;
+    n = atomic_fetch_add_explicit(checks,1,memory_order_relaxed)+1;
+    if (n <= coverage_target)
+        atomic_fetch_add_explicit(&stats[thread_id].reached[n],1,
+                                  memory_order_relaxed);
+}
+
+/* Passes over all the memory completed so far. `next` gets how much of the
+ * next one is done (0-1), or -1 when that isn't known. */
+unsigned coverage_passes(double *next) {
+    unsigned long t, n, pages;
+    unsigned passes = ~0U;
+    if (next) *next = -1;
+    if (patterns) {
+        for (t=0;t<num_threads;t++)
+            if (atomic_load(&stats[t].loops) < passes)
+                passes = atomic_load(&stats[t].loops);
+        return passes;
+    }
+    for (n=1;n<=coverage_target;n++) {
+        for (pages=0,t=0;t<num_threads;t++)
+            pages += atomic_load_explicit(&stats[t].reached[n],
+                                          memory_order_relaxed);
+        pages -= coverage_adjust[n];
+        if (pages < total_pages) {
+            if (next) *next = (double)pages/total_pages;
+            return n-1;
+        }
+    }
+    return coverage_target;
+}
+
+void print_coverage(void) {
+    unsigned long t, tested = 0;
+    double next;
+    unsigned passes = coverage_passes(&next);
+    for (t=0;t<num_threads;t++)
+        tested += atomic_load(&active_pages[t])*region_pagesize[t];
+    if (patterns)
+        printf("Coverage: %u full passes over %s, target %u "
+               "(pattern rounds of the slowest thread)\n",passes,
+               human_memsize(tested),coverage_target);
+    else
+        printf("Header coverage: every page header of %s checked %u times, "
+               "target %u (the rest of the pages isn't verified)\n",
+               human_memsize(tested),passes,coverage_target);
+    if (passes < coverage_target && next >= 0)
+        printf("Coverage target not reached, pass %u is %.1f%% done\n",
+               passes+1,(long)(next*1000.0)/10.0);
+    else if (passes < coverage_target)
+        printf("Coverage target not reached\n");
+}
+
+/* Memory limits and pressure. sysinfo() only knows about the machine, in a
+ * container, a snap or a limited session the cgroup v2 memory.max (or
+ * memory.high, past which the cgroup gets throttled) of the test or of
+ * any of its parents is what runs out first. The test is sized in what's
+ * left under them, after the page cache the kernel can drop.
+ *
+ * With -b, main() watches the memory PSI of the cgroup, or of the machine,
+ * once a second while the test runs. When tasks stalled on memory more than
+ * PRESSURE_STALL of the time, every region gives back an eighth of its
+ * pages from the end (with MADV_DONTNEED), down to a quarter of its initial
+ * size, so the test can run next to other jobs without swapping the
+ * machine to a halt. The memory isn't taken back later, and the test then
+ * exits with EXIT_BACKED_OFF (unless it failed) since it tested less than
+ * it was asked to. */
+#define PRESSURE_STALL 0.10
+#define EPOCH_LOOPS 1024
+#define BACKOFF_STEPS 8      /* fraction of a region given back each time */
+#define BACKOFF_FLOOR 4      /* regions don't shrink below 1/4 */
+#define EXIT_BACKED_OFF 3
+
+int watch_pressure = 0;
+char cgroup_path[4096] = "";  /* cgroup v2 directory of the test, if any */
+size_t cgroup_root_len = 0;   /* length of the v2 mount point in it */
+char psi_path[4096] = "";     /* memory PSI we watch, "" for none */
+unsigned long backoffs = 0;
+
+/* Find our cgroup v2 directory, from the "0::" line of /proc/self/cgroup.
+ * The v2 hierarchy is mounted at /sys/fs/cgroup, or in .../unified on
+ * hybrid setups. */
+void find_cgroup(void) {
+    const char *mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    char line[4096], path[4096+64];
+    unsigned i;
+    FILE *f = fopen("/proc/self/cgroup","r");
+    if (!f) return;
+    while (fgets(line,sizeof(line),f)) {
+        if (strncmp(line,"0::",3) != 0) continue;
+        line[strcspn(line,"\n")] = '\0';
+        for (i=0;i<sizeof(mounts)/sizeof(mounts[0]);i++) {
+            snprintf(path,sizeof(path),"%s/cgroup.controllers",mounts[i]);
+            if (access(path,R_OK) != 0) continue;
+            if (snprintf(cgroup_path,sizeof(cgroup_path),"%s%s",mounts[i],
+                         strcmp(line+3,"/") ? line+3 : "") >= (int)sizeof(cgroup_path))
+                cgroup_path[0] = '\0';
+            cgroup_root_len = strlen(mounts[i]);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+/* Value of a cgroup file holding one number, ULONG_MAX for "max" or when
+ * it can't be read. With a key, the value of that line of a flat keyed
+ * file like memory.stat. */
+unsigned long cgroup_value(const char *dir, const char *file, const char *key) {
+    char path[4096+64], line[256];
+    unsigned long value = ULONG_MAX;
+    size_t len = key ? strlen(key) : 0;
+    FILE *f;
+    snprintf(path,sizeof(path),"%s/%s",dir,file);
+    if (!(f = fopen(path,"r"))) return ULONG_MAX;
+    while (fgets(line,sizeof(line),f)) {
+        if (key && (strncmp(line,key,len) != 0 || line[len] != ' ')) continue;
+        if (strncmp(line+len+(key ? 1 : 0),"max",3) != 0)
+            value = strtoul(line+len+(key ? 1 : 0),NULL,10);
+        break;
+    }
+    fclose(f);
+    return value;
+}
+
+/* Memory left under the limits of our cgroup and its parents, ULONG_MAX
+ * if none of them has one */
+unsigned long cgroup_room(void) {
+    char dir[4096], *slash;
+    unsigned long room = ULONG_MAX;
+    if (!cgroup_path[0]) return room;
+    strcpy(dir,cgroup_path);
+    for (;;) {
+        unsigned long limit = cgroup_value(dir,"memory.max",NULL);
+        unsigned long high = cgroup_value(dir,"memory.high",NULL);
+        unsigned long current, cache, used;
+        if (high < limit) limit = high;
+        if (limit != ULONG_MAX &&
+            (current = cgroup_value(dir,"memory.current",NULL)) != ULONG_MAX) {
+            cache = cgroup_value(dir,"memory.stat","inactive_file");
+            used = cache != ULONG_MAX && cache < current ? current-cache : current;
+            if (limit < used) limit = used;
+            if (limit-used < room) room = limit-used;
+        }
+        if (strlen(dir) <= cgroup_root_len || !(slash = strrchr(dir,'/')))
+            break;
+        *slash = '\0';
+    }
+    return room;
+}
+
+/* The "some" stall time of a PSI file, in us, -1 if it can't be read */
+long long psi_some_total(const char *path) {
+    char line[256], *p;
+    long long total = -1;
+    FILE *f = fopen(path,"r");
+    if (!f) return -1;
+    while (fgets(line,sizeof(line),f))
+        if (strncmp(line,"some ",5) == 0 && (p = strstr(line,"total=")))
+            total = atoll(p+6);
+    fclose(f);
+    return total;
+}
+
+/* the cgroup's own pressure if it has any, the machine's otherwise */
+void find_psi(void) {
+    char path[4096+64];
+    snprintf(path,sizeof(path),"%s/memory.pressure",cgroup_path);
+    if (cgroup_path[0] && psi_some_total(path) >= 0)
+        strcpy(psi_path,path);
+    else if (psi_some_total("/proc/pressure/memory") >= 0)
+        strcpy(psi_path,"/proc/pressure/memory");
+}
+
+/* Shrink every region by a step. The pattern test threads trim their own
+ * region between two passes. Any random test thread may be reading any
+ * region, so here the new sizes are published first, then this waits for
+ * every thread to be past the sizes it had read and gives back the pages
+ * itself. Returns the number of regions shrunk. */
+unsigned back_off(void) {
+    unsigned long t, page, old_pages[num_threads], epochs[num_threads];
+    unsigned shrunk = 0, n;
+    for (t=0;t<num_threads;t++) {
+        unsigned long step = region_pages[t]/BACKOFF_STEPS, floor_pages =
+                             region_pages[t]/BACKOFF_FLOOR;
+        old_pages[t] = atomic_load(&active_pages[t]);
+        if (!step || old_pages[t] <= floor_pages) continue;
+        atomic_store(&active_pages[t],old_pages[t]-step > floor_pages ?
+                                      old_pages[t]-step : floor_pages);
+        shrunk++;
+    }
+    if (!shrunk || patterns) return shrunk;
+    /* A thread may have read the old size just before its epoch moved,
+     * the one after that is on the new sizes */
+    for (t=0;t<num_threads;t++)
+        epochs[t] = atomic_load(&stats[t].epoch);
+    for (t=0;t<num_threads && !done;)
+        if (atomic_load(&stats[t].epoch)-epochs[t] >= 2) t++;
+        else sched_yield();
+    if (done) return shrunk; /* the threads are about to unmap anyway */
+    for (t=0;t<num_threads;t++) {
+        unsigned long new_pages = atomic_load(&active_pages[t]);
+        if (new_pages == old_pages[t]) continue;
+        /* what the given back pages had counted for the coverage */
+        for (page=new_pages;page_checks && page<old_pages[t];page++)
+            for (n=1;n<=page_checks[t][page] && n<=coverage_target;n++)
+                coverage_adjust[n]++;
+        total_pages -= old_pages[t]-new_pages;
+        madvise(&mmap_regions[t][new_pages*region_pagesize[t]],
+                (old_pages[t]-new_pages)*region_pagesize[t],MADV_DONTNEED);
+    }
+    return shrunk;
+}
+
+/* Called by main() once a second. Compares the stall time since the last
+ * call to the time that went by. */
+void check_pressure(void) {
+    static long long last_total = -1;
+    static struct timeval last;
+    struct timeval now, elapsed;
+    long long total;
+    if (!psi_path[0]) return;
+    total = psi_some_total(psi_path);
+    gettimeofday(&now,NULL);
+    if (total >= 0 && last_total >= 0) {
+        double us;
+        timersub(&now,&last,&elapsed);
+        us = elapsed.tv_sec*1e6 + elapsed.tv_usec;
+        if (us > 0 && (total-last_total)/us > PRESSURE_STALL && back_off()) {
+            backoffs++;
+            if (verbose)
+                printf("Memory pressure: %.0f%% stalled, giving back memory\n",
+                       100.0*(total-last_total)/us);
+        }
+    }
+    last_total = total;
+    last = now;
+}
+
+/* The random test: `count` times, or until the test is over, pick a random
+ * page of a random region among `targets` (all of them if NULL), check the
+ * header we wrote there and read or write a random word of it */
+void random_test(unsigned long thread_id, uint64_t *rng,
+                 const unsigned *targets, unsigned ntargets,
+                 unsigned long count, unsigned long *my_node_loops,
+                 unsigned long *my_node_errors) {
+    volatile long garbage;
+    /* counted here, main() only reads them once the threads are done */
+    unsigned long loops = atomic_load_explicit(&stats[thread_id].loops,
+                                               memory_order_relaxed);
+    unsigned long p, j;
+    long *lp;
+    int t,offset;
+    uint64_t r;
+    while (!done && count--) {
         /* Choose a random thread and a random page */
-        t = rand() % num_threads;
-        p = rand() % pages;
-        lp = (long *)&(mmap_regions[t][p*pagesize]);
+        t = rng_below(rng, ntargets);
+        if (targets) t = targets[t];
+        p = rng_below(rng, atomic_load_explicit(&active_pages[t],
+                                                memory_order_relaxed));
+        lp = (long *)&(mmap_regions[t][p*region_pagesize[t]]);
         /* Check the info we wrote there earlier */
         if (lp[0] != 0xDEADBEEF || lp[1] != t || lp[2] != p) {
-            fprintf(stderr,"MEMORY CORRUPTION DETECTED\n");
-            fprintf(stderr,"thread %lu (CPU %lu) reading map %u, page %lu\n",
-                    thread_id,thread_id % num_cpus,t,p);
-            fprintf(stderr,"read: %#lx %lu %lu  should be: %#x %i %lu\n",
-                    lp[0],lp[1],lp[2],0xDEADBEEF,t,p);
+            long header[3] = { 0xDEADBEEF, t, p };
+            for (j=0;j<3;j++)
+                if (lp[j] != header[j])
+                    report_error(thread_id,t,p*region_pagesize[t]+j*sizeof(long),
+                                 lp[j],header[j]);
+            if (numa_mode != NUMA_NONE && region_node[t] >= 0)
+                my_node_errors[region_node[t]]++;
         }
+        if (page_checks) count_check(thread_id,t,p);
         /* choose a random word (other than the first 3 */
-        offset = (rand() % ((pagesize/sizeof(long))-3))+3;
-        if (rand() % 2) {
-            lp[offset] = rand();
+        r = rng_next(rng);
+        offset = rng_below(rng, (region_pagesize[t]/sizeof(long))-3)+3;
+        if (r & 1) {
+            lp[offset] = r >> 33;
         } else {
             garbage = lp[offset];
         }
-        loop_counters[thread_id]++;
+        loops++;
+        if (loops % EPOCH_LOOPS == 0)
+            atomic_fetch_add(&stats[thread_id].epoch,1);
+        if (numa_mode != NUMA_NONE && region_node[t] >= 0)
+            my_node_loops[region_node[t]]++;
+    }
+    atomic_store_explicit(&stats[thread_id].loops,loops,memory_order_relaxed);
+}
+
+/* This is the function that the threads run */
+void *mem_twiddler(void *arg) {
+    unsigned long thread_id = (uintptr_t)arg;
+    unsigned long pages, pagesize, i, j, chunk;
+    long *lp;
+    char *my_region;
+    unsigned long region_size = mapsize;
+    uint64_t rng;
+    unsigned my_node, *targets, ntargets;
+    unsigned long *my_node_loops, *my_node_errors;
+
+    rng = rng_seed(thread_id);
+    on_cpu(thread_id % num_cpus);
+    my_node = numa_mode == NUMA_NONE ? 0 : cpu_mem_node(thread_id % num_cpus);
+    targets = numa_mode == NUMA_NONE ? NULL : node_targets[my_node];
+    ntargets = numa_mode == NUMA_NONE ? num_threads : node_ntargets[my_node];
+    my_node_loops = calloc(num_nodes,sizeof(unsigned long));
+    my_node_errors = calloc(num_nodes,sizeof(unsigned long));
+
+    /* Map a chunk of memory */
+    if (verbose) printf("thread %ld: mapping %s RAM\n",
+                        thread_id,human_memsize(region_size));
+    my_region=map_region(&region_size,&pagesize);
+    if (my_region == MAP_FAILED) { perror("mmap"); exit(1); }
+    pages=region_size/pagesize;
+    /* before the first touch, which is what would place the pages */
+    if (numa_mode != NUMA_NONE) place_region(thread_id,my_region,region_size);
+    region_pagesize[thread_id] = pagesize;
+    region_pages[thread_id] = pages;
+    atomic_store(&active_pages[thread_id],pages);
+    mmap_regions[thread_id] = my_region;
+    if (page_checks) {
+        page_checks[thread_id] = calloc(pages,sizeof(atomic_uchar));
+        if (!page_checks[thread_id]) { perror("calloc"); exit(1); }
+    }
+    /* Dirty each page of the mem region to fault them into existence, a
+     * chunk at a time so main() can show the progress. MADV_POPULATE_WRITE
+     * has the kernel fault in a whole chunk at once, much faster than
+     * taking a fault per page; kernels before 5.14 don't know it, the header
+     * loop still faults the pages then. */
+    chunk = PREFAULT_CHUNK > pagesize ? PREFAULT_CHUNK/pagesize : 1;
+    for (i=0;i<pages;i+=chunk) {
+        unsigned long n = pages-i < chunk ? pages-i : chunk;
+        madvise(&my_region[i*pagesize],n*pagesize,MADV_POPULATE_WRITE);
+        for (j=i;j<i+n;j++) {
+            lp=(long *)&(my_region[j*pagesize]);
+            lp[0]=0xDEADBEEF; /* magic number */
+            lp[1]=thread_id;
+            lp[2]=j;
+        }
+        atomic_store_explicit(&stats[thread_id].prefaulted,(i+n)*pagesize,
+                              memory_order_relaxed);
+    }
+    /* Okay, we have grabbed our memory - this thread is now live */
+    atomic_fetch_add(&live_threads,1);
+    if (verbose) printf("thread %ld: mapping complete\n",thread_id);
+
+    /* Wait for the signal to begin testing */
+    pthread_barrier_wait(&start_barrier);
+    if (verbose) printf("thread %lu: test start\n",thread_id);
+    if (benchmark)
+        run_benchmark(thread_id,my_region,pages*pagesize,&rng);
+    else if (patterns)
+        pattern_test(thread_id,my_region,pages*pagesize,&rng);
+    else
+        random_test(thread_id,&rng,targets,ntargets,~0UL,
+                    my_node_loops,my_node_errors);
+    if (numa_mode != NUMA_NONE) {
+        memcpy(&node_loops[thread_id*num_nodes],my_node_loops,
+               num_nodes*sizeof(unsigned long));
+        memcpy(&node_errors[thread_id*num_nodes],my_node_errors,
+               num_nodes*sizeof(unsigned long));
     }
+    free(my_node_loops);
+    free(my_node_errors);
 
     /* make sure everyone's finished before we unmap */
-    pthread_mutex_lock(&finish_mutex);
     if (verbose) printf("thread %lu finished.\n",thread_id);
-    running_threads--;
-    if (running_threads==0)
-        pthread_cond_broadcast(&finish_cond);
-    else
-        while (running_threads) { pthread_cond_wait(&finish_cond,&finish_mutex); }
-    pthread_mutex_unlock(&finish_mutex);
+    pthread_barrier_wait(&finish_barrier);
 
     /* Clean up and exit. */
     if (verbose) printf("thread %lu unmapping and exiting\n",thread_id);
-    if (munmap(my_region,mapsize) != 0) {
+    if (munmap(my_region,region_size) != 0) {
         perror("munmap"); exit(2);
     }
     return NULL;
@@ -251,25 +1479,45 @@ void int_handler(int signum) { done=1; }
 
 /* print usage info (with name of binary) */
 void usage(void) {
-    printf("usage: %s [-h] [-v] [-q] [-p] [-t sec] [-n threads] [-m size]\n",
-            basename);
+    printf("usage: %s [-h] [-v] [-q] [-p] [-P] [-t sec] [-c passes] [-n threads] [-m size]\n"
+           "       [-s seed] [-N local|remote|interleave] [-H thp|2m|1g] [-B] [-b]\n",basename);
     printf("  -h: show this help\n");
     printf("  -v: verbose\n");
     printf("  -q: quiet (do not show progress meters)\n");
-    printf("  -p: parallel thread startup\n");
+    printf("  -p: parallel thread startup (always the case now)\n");
+    printf("  -P: sequential pattern passes over each thread's memory\n"
+           "      instead of random page checks\n");
     printf("  -t: test time, in seconds. default: %u\n",default_runtime);
+    printf("  -c: stop once the memory has been covered this many times (max %u):\n"
+           "      with -P full pattern rounds, otherwise only page header checks.\n"
+           "      -t is then only a time cap\n",MAX_COVERAGE);
     printf("  -n: number of threads. default: %u (2*num_cpus)\n",default_threads);
-    printf("  -m: memory usage. default: %s (%.0f%% of free RAM)\n",
+    printf("  -m: memory usage. default: %s (%.0f%% of free RAM, or of what\n"
+           "      the cgroup limits leave if that's less)\n",
             human_memsize(default_memsize),DEFAULT_MEMPCT*100.0);
+    printf("  -N: NUMA placement of the memory of each thread:\n"
+           "      local: on the node of the thread, checks stay on the node\n"
+           "      remote: checks (or the -P passes) go to other nodes\n"
+           "      interleave: spread over all nodes\n");
+    printf("  -H: back the memory with huge pages: transparent ones, or\n"
+           "      reserved 2M/1G hugetlb pages. Falls back to normal pages.\n");
+    printf("  -B: benchmark bandwidth and latency instead of testing,\n"
+           "      results are printed as key: value lines\n");
+    printf("  -b: give some of the memory back when other tasks stall on it\n"
+           "      (memory pressure), and then exit with %d\n",EXIT_BACKED_OFF);
+    printf("  -s: random seed, for reproducible runs. default: time based\n");
     printf("memory size may use k/m/g suffixes, or may be a percentage of total RAM.\n");
 }
 
+/* bench_threaded_memtest.c includes this file to get at the code above */
+#ifndef THREADED_MEMTEST_NO_MAIN
 int main(int argc, char **argv) {
     struct sysinfo info;
     struct sigaction mysig;
     int i,rv=0;
     float duration_f, loops_per_sec;
-    unsigned long free_mem, mapsize;
+    unsigned long free_mem, cgroup_free, total_map;
+    char *endptr;
 
     basename=strrchr(argv[0],'/');
     if (basename) basename++; else basename=argv[0];
@@ -284,16 +1532,22 @@ int main(int argc, char **argv) {
     if (sysinfo(&info) != 0) { perror("sysinfo"); return -1; }
     free_mem=(info.freeram+info.bufferram)*info.mem_unit;
     total_ram=info.totalram*info.mem_unit;
-    /* default to using most of free_mem */
-    default_memsize = free_mem * DEFAULT_MEMPCT;
+    find_cgroup();
+    cgroup_free = cgroup_room();
+    /* default to using most of free_mem, or of what the cgroup has left */
+    default_memsize = (free_mem < cgroup_free ? free_mem : cgroup_free)
+                      * DEFAULT_MEMPCT;
 
     /* Set configurable values to reasonable defaults */
     runtime = default_runtime;
     num_threads = default_threads;
     memsize = default_memsize;
+    gettimeofday(&start,NULL);
+    seed = (unsigned long)start.tv_sec * 1000000 + start.tv_usec;
+    timerclear(&start);
 
     /* parse options */
-    while ((i = getopt(argc,argv,"hvqpt:n:m:")) != -1) {
+    while ((i = getopt(argc,argv,"hvqpPBbt:c:n:m:s:N:H:")) != -1) {
         switch (i) {
             case 'h':
                 usage();
@@ -305,7 +1559,16 @@ int main(int argc, char **argv) {
                 quiet=1;
                 break;
             case 'p':
-                parallel=1;
+                /* threads always start in parallel */
+                break;
+            case 'P':
+                patterns=1;
+                break;
+            case 'B':
+                benchmark=1;
+                break;
+            case 'b':
+                watch_pressure=1;
                 break;
             case 't':
                 runtime=atoi(optarg);
@@ -314,6 +1577,13 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case 'c':
+                coverage_target=atoi(optarg);
+                if (!coverage_target || coverage_target > MAX_COVERAGE) {
+                    printf("%s: error: bad coverage \"%s\"\n",basename,optarg);
+                    return 1;
+                }
+                break;
             case 'n':
                 num_threads=atoi(optarg);
                 if (!num_threads) {
@@ -328,9 +1598,36 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case 'N':
+                for (numa_mode=NUMA_LOCAL;numa_mode<=NUMA_INTERLEAVE;numa_mode++)
+                    if (strcmp(optarg,numa_mode_names[numa_mode]) == 0) break;
+                if (numa_mode > NUMA_INTERLEAVE) {
+                    printf("%s: error: bad NUMA mode \"%s\"\n",basename,optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                for (hugepages=HUGE_THP;hugepages<=HUGE_1G;hugepages++)
+                    if (strcasecmp(optarg,hugepage_mode_names[hugepages]) == 0) break;
+                if (hugepages > HUGE_1G) {
+                    printf("%s: error: bad huge page mode \"%s\"\n",basename,optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                errno=0;
+                seed=strtoul(optarg,&endptr,0);
+                if (errno || *endptr || endptr == optarg) {
+                    printf("%s: error: bad seed \"%s\"\n",basename,optarg);
+                    return 1;
+                }
+                break;
         }
     }
 
+    detect_nodes();
+    if (numa_mode != NUMA_NONE) plan_numa();
+
     /* calculate mapsize now that memsize/num_threads is set */
     mapsize = memsize/num_threads;
     /* sanity checks */
@@ -338,6 +1635,12 @@ int main(int argc, char **argv) {
         printf("Warning: num_threads < num_cpus. This isn't usually a good idea.\n");
     if (memsize > free_mem)
         printf("Warning: memsize > free_mem. You will probably hit swap.\n");
+    if (memsize > cgroup_free)
+        printf("Warning: memsize > %s left under the cgroup memory limits. "
+               "The test will probably be OOM killed.\n",human_memsize(cgroup_free));
+    /* the benchmark has to keep its working sets */
+    if (benchmark) watch_pressure = 0;
+    if (watch_pressure) find_psi();
     /* A little information */
     if (verbose) {
         printf("Detected %u processors.\n",num_cpus);
@@ -345,42 +1648,118 @@ int main(int argc, char **argv) {
                 100.0*(double)free_mem/(double)total_ram,
                 human_memsize(free_mem));
         printf("%s)\n",human_memsize(total_ram));
+        if (cgroup_free != ULONG_MAX)
+            printf("cgroup %s: %s left under the memory limits\n",
+                   cgroup_path+cgroup_root_len,human_memsize(cgroup_free));
+        if (psi_path[0])
+            printf("Watching memory pressure in %s\n",psi_path);
+        else if (watch_pressure)
+            printf("No memory pressure information (PSI), not watching it\n");
+        printf("Random seed: %lu\n",seed);
+        if (numa_mode != NUMA_NONE)
+            printf("NUMA: %u node(s), %s placement.\n",num_nodes,
+                   numa_mode_names[numa_mode]);
     }
+    select_kernels();
+    if (verbose && patterns) printf("Using %s pattern kernels.\n",kernels.name);
 
-    printf("Testing %s RAM for %u seconds using %u threads:\n",
-            human_memsize(memsize),runtime,num_threads);
+    if (benchmark)
+        printf("Benchmarking %s RAM using %u threads:\n",
+               human_memsize(memsize),num_threads);
+    else if (coverage_target && patterns)
+        printf("Testing %s RAM %u times over, for at most %u seconds, using %u threads:\n",
+               human_memsize(memsize),coverage_target,runtime,num_threads);
+    else if (coverage_target)
+        printf("Testing %s RAM until every page header was checked %u times, "
+               "for at most %u seconds, using %u threads:\n",
+               human_memsize(memsize),coverage_target,runtime,num_threads);
+    else
+        printf("Testing %s RAM for %u seconds using %u threads:\n",
+               human_memsize(memsize),runtime,num_threads);
 
     /* Allocate room for thread info */
     threads=(pthread_t *)malloc(num_threads*sizeof(pthread_t));
     mmap_regions=(char **)malloc(num_threads*sizeof(char *));
-    loop_counters=(unsigned long *)malloc(num_threads*sizeof(unsigned long *));
-
-    /* Create all our threads! */
-    while (created_threads < num_threads) {
-        pthread_mutex_lock(&mmap_mutex);
-        mmap_done=0;
-        if (pthread_create(&threads[created_threads],NULL,
-                    mem_twiddler,(void*)&mapsize) != 0) {
-            perror("pthread_create"); exit(1);
+    region_pages=(unsigned long *)malloc(num_threads*sizeof(unsigned long));
+    region_pagesize=(unsigned long *)malloc(num_threads*sizeof(unsigned long));
+    active_pages=(atomic_ulong *)malloc(num_threads*sizeof(atomic_ulong));
+    if (posix_memalign((void **)&stats,CACHE_LINE,
+                       num_threads*sizeof(struct thread_stats)) != 0) {
+        perror("posix_memalign"); exit(1);
+    }
+    memset(stats,0,num_threads*sizeof(struct thread_stats));
+    if (posix_memalign((void **)&error_rings,CACHE_LINE,
+                       num_threads*sizeof(struct error_ring)) != 0) {
+        perror("posix_memalign"); exit(1);
+    }
+    memset(error_rings,0,num_threads*sizeof(struct error_ring));
+    if (coverage_target && !benchmark && !patterns) {
+        size_t counts = ((coverage_target+1)*sizeof(atomic_ulong)+CACHE_LINE-1)
+                        & ~(size_t)(CACHE_LINE-1);
+        page_checks = calloc(num_threads,sizeof(atomic_uchar *));
+        coverage_adjust = calloc(coverage_target+1,sizeof(unsigned long));
+        for (i=0;i<num_threads;i++) {
+            if (posix_memalign((void **)&stats[i].reached,CACHE_LINE,counts) != 0) {
+                perror("posix_memalign"); exit(1);
+            }
+            memset(stats[i].reached,0,counts);
         }
-        /* Wait for it to finish initializing */
-        while (!mmap_done) { pthread_cond_wait(&mmap_cond,&mmap_mutex); }
-        pthread_mutex_unlock(&mmap_mutex);
-        if (!verbose && !quiet)
-            progressbar("Starting threads",created_threads,num_threads);
+    }
+    /* only for the reports, so it's fine if we can't */
+    pagemap_fd = open("/proc/self/pagemap",O_RDONLY);
+    pthread_barrier_init(&start_barrier,NULL,num_threads+1);
+    pthread_barrier_init(&finish_barrier,NULL,num_threads);
+    if (benchmark) {
+        bench=(struct bench_result *)calloc(num_threads,sizeof(struct bench_result));
+        pthread_barrier_init(&bench_barrier,NULL,num_threads);
     }
 
-    if (parallel) {
-        /* Wait for the signal that everyone is finished initializing */
-        pthread_mutex_lock(&init_mutex);
-        while (live_threads < num_threads) { pthread_cond_wait(&init_cond,&init_mutex); }
-        pthread_mutex_unlock(&init_mutex);
+    /* Create all our threads! They map and fault in their memory at the
+     * same time, the thread id is passed as the argument. */
+    for (i=0;i<num_threads;i++) {
+        if (pthread_create(&threads[i],NULL,
+                    mem_twiddler,(void*)(uintptr_t)i) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+    }
+    /* Wait for them to finish initializing, showing how much of the RAM
+     * has been faulted in (in MiB) */
+    total_map = ((unsigned long)num_threads*mapsize)>>20;
+    if (!total_map) total_map=1;
+    while (live_threads < num_threads) {
+        if (!verbose && !quiet) {
+            unsigned long faulted = 0;
+            for (i=0;i<num_threads;i++)
+                faulted += atomic_load_explicit(&stats[i].prefaulted,
+                                                memory_order_relaxed);
+            faulted >>= 20;
+            progressbar("Starting threads",
+                        faulted < total_map ? faulted : total_map,total_map);
+        }
+        usleep(100000);
+    }
+    if (!verbose && !quiet)
+        progressbar("Starting threads",total_map,total_map);
+    for (i=0;i<num_threads;i++)
+        total_pages += region_pages[i];
+    /* hugetlb regions are rounded down to whole huge pages, so the working
+     * sets must fit in what was actually mapped */
+    if (benchmark) {
+        unsigned long smallest = ~0UL;
+        for (i=0;i<num_threads;i++)
+            if (region_pages[i]*region_pagesize[i] < smallest)
+                smallest = region_pages[i]*region_pagesize[i];
+        plan_latency(smallest);
     }
 
     /* Let the testing begin! */
     if (!verbose && !quiet) printf("\n");
+    if (hugepage_fallbacks)
+        printf("Warning: %u thread(s) couldn't get %s huge pages, using normal pages.\n",
+               hugepage_fallbacks,hugepage_mode_names[hugepages]);
     gettimeofday(&start,NULL);
-    pthread_cond_broadcast(&test_start);
+    /* the threads are released once they have all initialized */
+    pthread_barrier_wait(&start_barrier);
 
     /* catch ^C signal */
     mysig.sa_handler=int_handler;
@@ -388,21 +1767,23 @@ int main(int argc, char **argv) {
     mysig.sa_flags=0;
     sigaction(SIGINT,&mysig,NULL);
 
-    /* Wait for the allotted time */
+    /* Wait for the allotted time (with -c, at most), the benchmark takes as
+     * long as it takes */
     i=0;
-    while (!done && (i<runtime)) {
+    while (!benchmark && !done && (i<runtime)) {
         if (sleep(1) == 0) i++;
         if (!quiet) progressbar("Testing RAM",i,runtime);
+        if (watch_pressure) check_pressure();
+        if (coverage_target && coverage_passes(NULL) >= coverage_target) break;
     }
-    if (i != runtime)
+    if (!benchmark && i != runtime &&
+        !(coverage_target && coverage_passes(NULL) >= coverage_target))
         rv=1;
 
     /* Signal completion and join all threads */
     done=1;
-    while (live_threads) {
-        pthread_join(threads[live_threads-1],NULL);
-        live_threads--;
-    }
+    for (i=0;i<num_threads;i++)
+        pthread_join(threads[i],NULL);
     gettimeofday(&finish,NULL);
     if (!quiet) printf("\n");
     /* Test is officially complete. Calculate run speed. */
@@ -410,16 +1791,81 @@ int main(int argc, char **argv) {
     duration_f=(float)duration.tv_sec + (float)duration.tv_usec / 1000000.0;
     loops_per_sec=0;
     if (verbose) printf("Runtime was %.2fs\n",duration_f);
+    if (benchmark) {
+        print_benchmark();
+        printf("Benchmark complete.\n");
+        return rv;
+    }
+    /* with -P a loop is a pass of every pattern over the whole region */
     for (i=0;i<num_threads;i++) {
-        if (verbose) printf("thread %i: %lu loops\n",i,loop_counters[i]);
-        loops_per_sec += (float)loop_counters[i]/duration_f;
+        if (verbose) printf("thread %i: %lu %s\n",i,stats[i].loops,
+                            patterns ? "passes" : "loops");
+        loops_per_sec += (float)stats[i].loops/duration_f;
     }
-    printf("Total loops per second: %.2f\n",loops_per_sec);
+    printf("Total %s per second: %.2f\n",patterns ? "passes" : "loops",
+           loops_per_sec);
+    if (coverage_target) print_coverage();
+    if (backoffs) {
+        unsigned long end_bytes = 0, start_bytes = 0;
+        for (i=0;i<num_threads;i++) {
+            end_bytes += atomic_load(&active_pages[i])*region_pagesize[i];
+            start_bytes += region_pages[i]*region_pagesize[i];
+        }
+        printf("Warning: memory pressure: gave memory back %lu times, ",backoffs);
+        printf("tested %s at the end, ",human_memsize(end_bytes));
+        printf("%s at the start\n",human_memsize(start_bytes));
+        if (!rv) rv = EXIT_BACKED_OFF;
+    }
+    if (patterns) {
+        unsigned long total_verified=0, total_errors=0;
+        for (i=0;i<num_threads;i++) {
+            if (verbose) printf("thread %i: %s verified, %lu errors\n",i,
+                                human_memsize(stats[i].verified_bytes),stats[i].errors);
+            total_verified += stats[i].verified_bytes;
+            total_errors += stats[i].errors;
+        }
+        printf("Total bytes verified: %lu (%s)\n",total_verified,
+               human_memsize(total_verified));
+        printf("Verified per second: %s\n",
+               human_memsize(total_verified/duration_f));
+        printf("Errors found: %lu\n",total_errors);
+        if (total_errors)
+            rv=1;
+    }
+    if (numa_mode == NUMA_INTERLEAVE) {
+        printf("node breakdown not available with interleaved memory\n");
+    } else if (numa_mode != NUMA_NONE) {
+        unsigned n, t;
+        for (n=0;n<num_nodes;n++) {
+            unsigned long loops=0, errors=0, verified=0;
+            if (!mem_nodes[n]) continue;
+            for (t=0;t<num_threads;t++) {
+                if (patterns && region_node[t] == (int)n) {
+                    verified += stats[t].verified_bytes;
+                    errors += stats[t].errors;
+                } else if (!patterns) {
+                    loops += node_loops[t*num_nodes+n];
+                    errors += node_errors[t*num_nodes+n];
+                }
+            }
+            if (patterns) {
+                printf("node %u: %s verified, ",n,human_memsize(verified));
+                printf("%s per second, %lu errors\n",
+                       human_memsize(verified/duration_f),errors);
+            } else {
+                printf("node %u: %.2f loops per second, %lu errors\n",
+                       n,(float)loops/duration_f,errors);
+            }
+        }
+    }
+
+    print_error_summary();
 
     /* All done. Return success. */
     printf("Testing complete.\n");
     return rv;
 }
+#endif /* THREADED_MEMTEST_NO_MAIN */
 #else
 int main(int argc, char **argv) {
     printf("Unsupported architecture\n");
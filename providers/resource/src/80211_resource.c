@@ -30,6 +30,17 @@
 #include <errno.h>
 #include <stdbool.h>
 
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 
@@ -47,6 +58,35 @@ struct wireless_capabilities {
   unsigned int n_support : 1;
   unsigned int bg_support : 1;
   unsigned int band_5GHz_support : 1;
+  unsigned int ax_support : 1;
+  unsigned int be_support : 1;
+  unsigned int band_6GHz_support : 1;
+  unsigned int width_80MHz_support : 1;
+  unsigned int width_160MHz_support : 1;
+  unsigned int width_320MHz_support : 1;
+  unsigned int spatial_streams;
+  unsigned int max_phy_rate;	/* Mb/s */
+};
+
+#define MAX_WIPHYS 32
+#define MAX_INTERFACES 8
+
+/* Everything we learn about one radio. With split dumps a wiphy comes in
+ * several messages, so the capabilities are accumulated by wiphy index. */
+struct wiphy_info {
+	uint32_t index;
+	char name[32];
+	struct wireless_capabilities cap;
+	unsigned long long iftypes;	/* BIT(enum nl80211_iftype) */
+	char interfaces[MAX_INTERFACES][IFNAMSIZ];
+	int n_interfaces;
+	const char *bus;		/* "pci", "sdio" or "usb", NULL if unknown */
+	unsigned int vendor, device;
+};
+
+struct wiphy_table {
+	struct wiphy_info wiphys[MAX_WIPHYS];
+	int n_wiphys;
 };
 
 static const char *ifmodes[] = {
@@ -66,6 +106,12 @@ static const char *ifmodes[] = {
 
 #define BIT(x) (1ULL<<(x))
 
+/* Large enough for the burst of messages of a dump over several radios;
+ * libnl then sizes its own buffer for each message (msg_peek), so an
+ * unsplit wiphy message larger than a page isn't truncated either. */
+#define NL_RX_BUFFER_SIZE (256 * 1024)
+#define NL_TX_BUFFER_SIZE 8192
+
 static int nl80211_init(struct nl80211_state *state)
 {
 	int err;
@@ -76,7 +122,9 @@ static int nl80211_init(struct nl80211_state *state)
 		return -ENOMEM;
 	}
 
-	nl_socket_set_buffer_size(state->nl_sock, 8192, 8192);
+	nl_socket_set_buffer_size(state->nl_sock, NL_RX_BUFFER_SIZE,
+				  NL_TX_BUFFER_SIZE);
+	nl_socket_enable_msg_peek(state->nl_sock);
 
 	if (genl_connect(state->nl_sock)) {
 		fprintf(stderr, "Failed to connect to generic netlink.\n");
@@ -118,6 +166,85 @@ static int finish_handler(struct nl_msg *msg, void *arg)
 	return NL_SKIP;
 }
 
+static int ack_handler(struct nl_msg *msg, void *arg)
+{
+	int *ret = arg;
+	*ret = 0;
+	return NL_STOP;
+}
+
+/* Send a dump request for @cmd and feed every reply to @handler.
+ * @arg split    ask for a split wiphy dump
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+static int nl80211_dump(struct nl80211_state *state, int cmd, bool split,
+			int (*handler)(struct nl_msg *, void *), void *arg)
+{
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	int err;
+
+	msg = nlmsg_alloc();
+	if (!msg) {
+		fprintf(stderr, "failed to allocate netlink message\n");
+		return -ENOMEM;
+	}
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb) {
+		fprintf(stderr, "failed to allocate netlink callbacks\n");
+		err = -ENOMEM;
+		goto out_free_msg;
+	}
+
+	genlmsg_put(msg, 0, 0, state->nl80211_id, 0, NLM_F_DUMP, cmd, 0);
+#if HAVE_NL80211_ATTR_SPLIT_WIPHY_DUMP
+	/* Kernels without split dumps ignore the flag */
+	if (split)
+		nla_put_flag(msg, NL80211_ATTR_SPLIT_WIPHY_DUMP);
+#endif
+
+	err = nl_send_auto_complete(state->nl_sock, msg);
+	if (err < 0)
+		goto out;
+
+	err = 1;
+	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, handler, arg);
+
+	while (err > 0) {
+		int ret = nl_recvmsgs(state->nl_sock, cb);
+		if (ret < 0 && err > 0)
+			err = ret;
+	}
+ out:
+	nl_cb_put(cb);
+ out_free_msg:
+	nlmsg_free(msg);
+	return err;
+}
+
+/* The entry of wiphy @index, added if it's new, NULL if the table is full */
+static struct wiphy_info *get_wiphy(struct wiphy_table *table,
+				    uint32_t index)
+{
+	struct wiphy_info *wiphy;
+	int i;
+
+	for (i = 0; i < table->n_wiphys; i++)
+		if (table->wiphys[i].index == index)
+			return &table->wiphys[i];
+	if (table->n_wiphys == MAX_WIPHYS)
+		return NULL;
+	wiphy = &table->wiphys[table->n_wiphys++];
+	memset(wiphy, 0, sizeof(*wiphy));
+	wiphy->index = index;
+	snprintf(wiphy->name, sizeof(wiphy->name), "phy%u", index);
+	return wiphy;
+}
+
 /* Search for a specific pattern inside the given file handle.
  * @arg fp         a FILE pointer
  * @arg pattern    the search pattern
@@ -133,6 +260,7 @@ static int heuristic_test(FILE *fp, const char *pattern)
 
     while ((read = getline(&line, &len, fp)) != -1) {
         if ((p = strstr(line, pattern)) != NULL) {
+            free(line);
             return 0;
         }
     }
@@ -140,6 +268,396 @@ static int heuristic_test(FILE *fp, const char *pattern)
     return 1;
 }
 
+/* 802.11ac PCI devices whose drivers don't report VHT (or didn't, in some
+ * kernel version still around) */
+static const struct {
+	unsigned short vendor, device;
+} vht_devices[] = {
+	/* Intel */
+	{ 0x8086, 0x08b1 }, { 0x8086, 0x08b2 },	/* Wireless 7260 */
+	{ 0x8086, 0x095a }, { 0x8086, 0x095b },	/* Wireless 7265 */
+	{ 0x8086, 0x3165 }, { 0x8086, 0x3166 },	/* Wireless 3165 */
+	{ 0x8086, 0x24fb },			/* Wireless 3168 */
+	{ 0x8086, 0x24f3 },			/* Wireless 8260 */
+	{ 0x8086, 0x24fd },			/* Wireless 8265 */
+	{ 0x8086, 0x2526 },			/* Wireless-AC 9260 */
+	{ 0x8086, 0x9df0 }, { 0x8086, 0x31dc },	/* Wireless-AC 9560 */
+	{ 0x8086, 0xa370 }, { 0x8086, 0x30dc },
+	/* Qualcomm Atheros */
+	{ 0x168c, 0x003c },			/* QCA988x */
+	{ 0x168c, 0x003e },			/* QCA6174 */
+	{ 0x168c, 0x0040 },			/* QCA99x0 */
+	{ 0x168c, 0x0041 },			/* QCA6164 */
+	{ 0x168c, 0x0042 },			/* QCA9377 */
+	{ 0x168c, 0x0046 },			/* QCA9984 */
+	{ 0x168c, 0x0050 },			/* QCA9887 */
+	{ 0x168c, 0x0056 },			/* QCA9888 */
+	/* Realtek */
+	{ 0x10ec, 0x8821 },			/* RTL8821AE */
+	{ 0x10ec, 0xb822 },			/* RTL8822BE */
+	{ 0x10ec, 0xc821 },			/* RTL8821CE */
+	{ 0x10ec, 0xc822 },			/* RTL8822CE */
+	/* Broadcom */
+	{ 0x14e4, 0x43a0 },			/* BCM4360 */
+	{ 0x14e4, 0x43a3 },			/* BCM4350 */
+	{ 0x14e4, 0x43b1 },			/* BCM4352 */
+	{ 0x14e4, 0x43ba },			/* BCM43602 */
+	/* MediaTek */
+	{ 0x14c3, 0x7610 },			/* MT7610E */
+	{ 0x14c3, 0x7662 },			/* MT7662E */
+};
+
+/* Read a number such as "0x8086" (PCI) or "8086" (USB) from sysfs.
+ * @return 0 on success 1 otherwise.
+ */
+static int read_id(const char *path, unsigned int *id)
+{
+	FILE *fp = fopen(path, "r");
+	int ret;
+
+	if (!fp)
+		return 1;
+	ret = fscanf(fp, "%x", id) == 1 ? 0 : 1;
+	fclose(fp);
+	return ret;
+}
+
+/* The bus of the device behind a wiphy, from its subsystem link
+ * (.../bus/pci, .../bus/sdio): both have vendor and device files, with
+ * IDs from different lists.
+ * @return "pci", "sdio" or NULL.
+ */
+static const char *get_bus(const struct wiphy_info *wiphy)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	const char *name;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/sys/class/ieee80211/%s/device/subsystem",
+		 wiphy->name);
+	len = readlink(path, target, sizeof(target) - 1);
+	if (len < 0)
+		return NULL;
+	target[len] = '\0';
+	name = strrchr(target, '/');
+	name = name ? name + 1 : target;
+	if (strcmp(name, "pci") == 0)
+		return "pci";
+	if (strcmp(name, "sdio") == 0)
+		return "sdio";
+	return NULL;
+}
+
+/* Find the vendor/device IDs of the device behind a wiphy, through
+ * /sys/class/ieee80211/<phy>/device: a PCI or SDIO function, or a USB
+ * interface whose parent has the IDs. */
+static void get_device_ids(struct wiphy_info *wiphy)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/sys/class/ieee80211/%s/device/vendor",
+		 wiphy->name);
+	if (read_id(path, &wiphy->vendor) == 0) {
+		snprintf(path, sizeof(path),
+			 "/sys/class/ieee80211/%s/device/device", wiphy->name);
+		if (read_id(path, &wiphy->device) == 0)
+			wiphy->bus = get_bus(wiphy);
+		return;
+	}
+	snprintf(path, sizeof(path),
+		 "/sys/class/ieee80211/%s/device/../idVendor", wiphy->name);
+	if (read_id(path, &wiphy->vendor) == 0) {
+		snprintf(path, sizeof(path),
+			 "/sys/class/ieee80211/%s/device/../idProduct", wiphy->name);
+		if (read_id(path, &wiphy->device) == 0)
+			wiphy->bus = "usb";
+	}
+}
+
+/* Look the device name up in pci.ids, which is what lspci would print,
+ * without walking the whole bus.
+ * @return 0 if the name has @pattern, 1 otherwise.
+ */
+static int pci_ids_test(unsigned int vendor, unsigned int device,
+			const char *pattern)
+{
+	static const char *paths[] = {
+		"/usr/share/misc/pci.ids",
+		"/usr/share/hwdata/pci.ids",
+	};
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp = NULL;
+	bool in_vendor = false;
+	unsigned int id;
+	unsigned int i;
+	int ret = 1;
+
+	for (i = 0; !fp && i < sizeof(paths) / sizeof(paths[0]); i++)
+		fp = fopen(paths[i], "r");
+	if (!fp)
+		return 1;
+	while (getline(&line, &len, fp) != -1) {
+		/* "vvvv  Vendor", then "\tdddd  Device" lines */
+		if (line[0] != '\t') {
+			if (in_vendor)
+				break;
+			in_vendor = sscanf(line, "%4x", &id) == 1 && id == vendor;
+		} else if (in_vendor && line[1] != '\t' &&
+			   sscanf(line + 1, "%4x", &id) == 1 && id == device) {
+			ret = strstr(line, pattern) ? 0 : 1;
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/* Does a device known to do 802.11ac hide behind this wiphy?
+ * @return 0 if so, 1 if not, -1 if the device couldn't be identified.
+ */
+static int device_heuristic_test(const struct wiphy_info *wiphy)
+{
+	unsigned int i;
+
+	if (!wiphy->bus)
+		return -1;
+	/* the table and pci.ids only have PCI IDs */
+	if (strcmp(wiphy->bus, "pci") != 0)
+		return 1;
+	for (i = 0; i < sizeof(vht_devices) / sizeof(vht_devices[0]); i++)
+		if (vht_devices[i].vendor == wiphy->vendor &&
+		    vht_devices[i].device == wiphy->device)
+			return 0;
+	return pci_ids_test(wiphy->vendor, wiphy->device, "802.11ac");
+}
+
+/* Bits per subcarrier (modulation times coding rate) of MCS 0 to 13 */
+static const double mcs_bits[] = {
+	0.5, 1, 1.5, 2, 3, 4, 4.5, 5, 6, 20.0 / 3, 7.5, 25.0 / 3, 9, 10
+};
+
+/* Data subcarriers for 20, 40, 80, 160 and 320 MHz */
+static const unsigned int ht_subcarriers[] = { 52, 108, 234, 468, 0 };
+static const unsigned int he_subcarriers[] = { 234, 468, 980, 1960, 3920 };
+
+static unsigned int width_index(unsigned int width)
+{
+	unsigned int i;
+
+	for (i = 0; width > 20; i++)
+		width /= 2;
+	return i;
+}
+
+/* Theoretical PHY rate in Mb/s; HT/VHT symbols last 3.2 us, HE/EHT ones
+ * 12.8 us, plus the guard interval */
+static unsigned int phy_rate(bool he, unsigned int width, unsigned int mcs,
+			     unsigned int streams, double gi)
+{
+	const unsigned int *subcarriers = he ? he_subcarriers : ht_subcarriers;
+	double symbol = (he ? 12.8 : 3.2) + gi;
+
+	return subcarriers[width_index(width)] * mcs_bits[mcs] * streams / symbol;
+}
+
+/* Streams and highest MCS of a VHT/HE MCS map: 2 bits per stream, 3 for
+ * stream not supported, else the highest MCS is 7 + 2 bits value times
+ * @step (VHT: 0-7, 0-8, 0-9; HE: 0-7, 0-9, 0-11) */
+static unsigned int mcs_map_streams(uint16_t map, unsigned int step,
+				    unsigned int *mcs)
+{
+	unsigned int ss, streams = 0;
+
+	*mcs = 0;
+	for (ss = 0; ss < 8; ss++) {
+		unsigned int value = (map >> (2 * ss)) & 3;
+		if (value == 3)
+			continue;
+		streams = ss + 1;
+		if (7 + value * step > *mcs)
+			*mcs = 7 + value * step;
+	}
+	return streams;
+}
+
+static void update_rate(struct wireless_capabilities *cap,
+			unsigned int streams, unsigned int rate)
+{
+	if (streams > cap->spatial_streams)
+		cap->spatial_streams = streams;
+	if (rate > cap->max_phy_rate)
+		cap->max_phy_rate = rate;
+}
+
+static void set_width(struct wireless_capabilities *cap, unsigned int width)
+{
+	if (width >= 80)
+		cap->width_80MHz_support = true;
+	if (width >= 160)
+		cap->width_160MHz_support = true;
+	if (width >= 320)
+		cap->width_320MHz_support = true;
+}
+
+#if HAVE_NL80211_BAND_ATTR_IFTYPE_DATA
+/* 802.11ax (HE) and 802.11be (EHT) capabilities of some interface types */
+static void decode_iftype_data(struct wireless_capabilities *cap,
+			       int band, struct nlattr *nl_iftype)
+{
+	struct nlattr *tb[NL80211_BAND_IFTYPE_ATTR_MAX + 1];
+	const uint8_t *phy, *mcs_set;
+	unsigned int width = 20, rate_width, streams, mcs, len, he_widths;
+
+	nla_parse(tb, NL80211_BAND_IFTYPE_ATTR_MAX, nla_data(nl_iftype),
+		  nla_len(nl_iftype), NULL);
+	if (!tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_PHY] ||
+	    nla_len(tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_PHY]) < 1 ||
+	    !tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_MCS_SET] ||
+	    nla_len(tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_MCS_SET]) < 4)
+		return;
+	cap->ax_support = true;
+
+	/* Channel width set, bits 1-4 of the first PHY capabilities byte:
+	 * 40 MHz at 2.4 GHz, 40/80 MHz at 5/6 GHz, 160 MHz, 80+80 MHz */
+	phy = nla_data(tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_PHY]);
+	he_widths = (phy[0] >> 1) & 0xf;
+	if (band == NL80211_BAND_2GHZ) {
+		if (he_widths & 1)
+			width = 40;
+	} else {
+		if (he_widths & 2)
+			width = 80;
+		if (he_widths & 0xc)
+			width = 160;
+	}
+
+	/* <= 80 MHz rx map first, then tx, then the 160 MHz ones */
+	mcs_set = nla_data(tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_MCS_SET]);
+	len = nla_len(tb[NL80211_BAND_IFTYPE_ATTR_HE_CAP_MCS_SET]);
+	streams = mcs_map_streams(mcs_set[0] | mcs_set[1] << 8, 2, &mcs);
+	/* the width the rate is best at, which isn't always the widest */
+	rate_width = width;
+	if (width == 160 && len >= 6) {
+		unsigned int mcs160;
+		unsigned int streams160 = mcs_map_streams(mcs_set[4] |
+							  mcs_set[5] << 8, 2,
+							  &mcs160);
+		if (streams160 * mcs_bits[mcs160] * 2 <
+		    streams * mcs_bits[mcs]) {
+			/* narrower with more streams is faster */
+			rate_width = 80;
+		} else {
+			streams = streams160;
+			mcs = mcs160;
+		}
+	}
+	if (!streams)
+		return;
+	set_width(cap, width);
+	update_rate(cap, streams, phy_rate(true, rate_width, mcs, streams, 0.8));
+
+#if HAVE_NL80211_BAND_IFTYPE_ATTR_EHT_CAP_PHY
+	if (!tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_PHY] ||
+	    nla_len(tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_PHY]) < 1 ||
+	    !tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_MCS_SET] ||
+	    nla_len(tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_MCS_SET]) < 3)
+		return;
+	cap->be_support = true;
+	phy = nla_data(tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_PHY]);
+	/* bit 1: 320 MHz, only at 6 GHz */
+	if (band != NL80211_BAND_2GHZ && band != NL80211_BAND_5GHZ &&
+	    (phy[0] & 0x2))
+		width = rate_width = 320;
+
+	/* One byte per MCS range, the low nibble has the rx streams: 0-7,
+	 * 8-9, 10-11, 12-13 for 20 MHz only devices, otherwise 0-9, 10-11,
+	 * 12-13 for each width */
+	mcs_set = nla_data(tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_MCS_SET]);
+	len = nla_len(tb[NL80211_BAND_IFTYPE_ATTR_EHT_CAP_MCS_SET]);
+	{
+		static const unsigned int mcs20[] = { 7, 9, 11, 13 };
+		static const unsigned int mcs_wide[] = { 9, 11, 13 };
+		bool only20 = he_widths == 0 && len >= 4;
+		const unsigned int *top = only20 ? mcs20 : mcs_wide;
+		unsigned int i, n = only20 ? 4 : 3;
+
+		streams = mcs = 0;
+		for (i = 0; i < n; i++) {
+			unsigned int rx = mcs_set[i] & 0xf;
+			if (!rx)
+				continue;
+			if (rx > streams)
+				streams = rx;
+			mcs = top[i];
+		}
+	}
+	if (!streams)
+		return;
+	set_width(cap, width);
+	update_rate(cap, streams, phy_rate(true, rate_width, mcs, streams, 0.8));
+#endif
+}
+#endif
+
+/* Widths, streams and PHY rate of HT and VHT, and whatever HE/EHT add */
+static void decode_band(struct wireless_capabilities *cap, int band,
+			struct nlattr **tb_band)
+{
+	unsigned int streams = 0, mcs, width, i;
+
+#if HAVE_NL80211_BAND_ATTR_HT_CAPA
+	/* HT: MCS 0-7 for each stream with rx bits in the first 4 bytes */
+	if (tb_band[NL80211_BAND_ATTR_HT_CAPA] &&
+	    tb_band[NL80211_BAND_ATTR_HT_MCS_SET] &&
+	    nla_len(tb_band[NL80211_BAND_ATTR_HT_MCS_SET]) >= 4) {
+		uint16_t ht_capa = nla_get_u16(tb_band[NL80211_BAND_ATTR_HT_CAPA]);
+		const uint8_t *mcs_set = nla_data(tb_band[NL80211_BAND_ATTR_HT_MCS_SET]);
+		bool ht40 = ht_capa & BIT(1);
+		bool sgi = ht_capa & (ht40 ? BIT(6) : BIT(5));
+
+		for (i = 0; i < 4; i++)
+			if (mcs_set[i])
+				streams = i + 1;
+		if (streams)
+			update_rate(cap, streams,
+				    phy_rate(false, ht40 ? 40 : 20, 7, streams,
+					     sgi ? 0.4 : 0.8));
+	}
+#endif
+#if HAVE_NL80211_BAND_ATTR_VHT_CAPA && HAVE_NL80211_BAND_ATTR_VHT_MCS_SET
+	/* VHT: 80 MHz always, 160 MHz if the supported width set says so */
+	if (tb_band[NL80211_BAND_ATTR_VHT_CAPA] &&
+	    tb_band[NL80211_BAND_ATTR_VHT_MCS_SET] &&
+	    nla_len(tb_band[NL80211_BAND_ATTR_VHT_MCS_SET]) >= 2) {
+		uint32_t vht_capa = nla_get_u32(tb_band[NL80211_BAND_ATTR_VHT_CAPA]);
+		const uint8_t *mcs_set = nla_data(tb_band[NL80211_BAND_ATTR_VHT_MCS_SET]);
+		bool sgi;
+
+		width = ((vht_capa >> 2) & 3) ? 160 : 80;
+		sgi = vht_capa & (width == 160 ? BIT(6) : BIT(5));
+		streams = mcs_map_streams(mcs_set[0] | mcs_set[1] << 8, 1, &mcs);
+		if (streams) {
+			set_width(cap, width);
+			update_rate(cap, streams,
+				    phy_rate(false, width, mcs, streams,
+					     sgi ? 0.4 : 0.8));
+		}
+	}
+#endif
+#if HAVE_NL80211_BAND_ATTR_IFTYPE_DATA
+	if (tb_band[NL80211_BAND_ATTR_IFTYPE_DATA]) {
+		struct nlattr *nl_iftype;
+		int rem_iftype;
+
+		nla_for_each_nested(nl_iftype, tb_band[NL80211_BAND_ATTR_IFTYPE_DATA],
+				    rem_iftype)
+			decode_iftype_data(cap, band, nl_iftype);
+	}
+#endif
+}
+
 static int print_phy_handler(struct nl_msg *msg, void *arg)
 {
 	struct nlattr *tb_msg[NL80211_ATTR_MAX + 1];
@@ -149,12 +667,24 @@ static int print_phy_handler(struct nl_msg *msg, void *arg)
 	struct nlattr *nl_band;
 	struct nlattr *nl_freq;
 	struct nlattr *nl_mode;
-	struct wireless_capabilities *cap = arg;
+	struct wiphy_table *table = arg;
+	struct wiphy_info *wiphy;
+	struct wireless_capabilities *cap;
 	int rem_band, rem_freq, rem_mode;
 
 	nla_parse(tb_msg, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
+	if (!tb_msg[NL80211_ATTR_WIPHY])
+		return NL_SKIP;
+	wiphy = get_wiphy(table, nla_get_u32(tb_msg[NL80211_ATTR_WIPHY]));
+	if (!wiphy)
+		return NL_SKIP;
+	cap = &wiphy->cap;
+	if (tb_msg[NL80211_ATTR_WIPHY_NAME])
+		snprintf(wiphy->name, sizeof(wiphy->name), "%s",
+			 nla_get_string(tb_msg[NL80211_ATTR_WIPHY_NAME]));
+
 	if (tb_msg[NL80211_ATTR_WIPHY_BANDS]) {
 		nla_for_each_nested(nl_band, tb_msg[NL80211_ATTR_WIPHY_BANDS], rem_band) {
 			nla_parse(tb_band, NL80211_BAND_ATTR_MAX, nla_data(nl_band),
@@ -172,6 +702,7 @@ static int print_phy_handler(struct nl_msg *msg, void *arg)
 #endif
             /* Always assume 802.11b/g support */
             cap->bg_support = true;
+            decode_band(cap, nla_type(nl_band), tb_band);
 
 			if (tb_band[NL80211_BAND_ATTR_FREQS]) {
 				nla_for_each_nested(nl_freq, tb_band[NL80211_BAND_ATTR_FREQS], rem_freq) {
@@ -187,6 +718,8 @@ static int print_phy_handler(struct nl_msg *msg, void *arg)
                     /* http://en.wikipedia.org/wiki/List_of_WLAN_channels */
                     if (freq >= 4915 && freq <= 5825) 
 						cap->band_5GHz_support = true;
+                    if (freq >= 5925 && freq <= 7125)
+						cap->band_6GHz_support = true;
 				}
 			}
 		}
@@ -195,77 +728,142 @@ static int print_phy_handler(struct nl_msg *msg, void *arg)
 	if (tb_msg[NL80211_ATTR_SUPPORTED_IFTYPES]) {
 		nla_for_each_nested(nl_mode, tb_msg[NL80211_ATTR_SUPPORTED_IFTYPES], rem_mode) {
             enum nl80211_iftype iftype = nla_type(nl_mode);
-            if (iftype <= NL80211_IFTYPE_MAX && ifmodes[iftype])
-                printf("%s: supported\n", ifmodes[iftype]);
+            if (iftype <= NL80211_IFTYPE_MAX)
+                wiphy->iftypes |= BIT(iftype);
         }
 	}
 
-    return 0;
+    return NL_SKIP;
 }
 
-int main(int argc, char **argv)
+static int print_iface_handler(struct nl_msg *msg, void *arg)
 {
-	struct nl80211_state nlstate;
-	struct wireless_capabilities cap;
-	int err;
-	FILE *pci_fp;
-
-	err = nl80211_init(&nlstate);
-	if (err)
-		return 1;
-
-	struct nl_cb *cb;
-	struct nl_cb *s_cb;
-	struct nl_msg *msg;
-
-	msg = nlmsg_alloc();
-	if (!msg) {
-		fprintf(stderr, "failed to allocate netlink message\n");
-		return 2;
-	}
+	struct nlattr *tb_msg[NL80211_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct wiphy_table *table = arg;
+	struct wiphy_info *wiphy;
 
-	cb = nl_cb_alloc(NL_CB_DEFAULT);
-	s_cb = nl_cb_alloc(NL_CB_DEFAULT);
-	if (!cb || !s_cb) {
-		fprintf(stderr, "failed to allocate netlink callbacks\n");
-		err = 2;
-		goto out_free_msg;
-	}
+	nla_parse(tb_msg, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	genlmsg_put(msg, 0, 0, nlstate.nl80211_id, 0,
-		    NLM_F_DUMP, NL80211_CMD_GET_WIPHY, 0);
+	if (!tb_msg[NL80211_ATTR_WIPHY] || !tb_msg[NL80211_ATTR_IFNAME])
+		return NL_SKIP;
+	wiphy = get_wiphy(table, nla_get_u32(tb_msg[NL80211_ATTR_WIPHY]));
+	if (!wiphy || wiphy->n_interfaces == MAX_INTERFACES)
+		return NL_SKIP;
+	snprintf(wiphy->interfaces[wiphy->n_interfaces++], IFNAMSIZ, "%s",
+		 nla_get_string(tb_msg[NL80211_ATTR_IFNAME]));
+	return NL_SKIP;
+}
 
-	nl_socket_set_cb(nlstate.nl_sock, s_cb);
+static void print_capabilities(FILE *out, const struct wireless_capabilities *cap)
+{
+    if (cap->ac_support)
+        fprintf(out, "ac: supported\n");
+    if (cap->n_support)
+        fprintf(out, "n: supported\n");
+    if (cap->bg_support)
+        fprintf(out, "bg: supported\n");
+    if (cap->band_5GHz_support)
+        fprintf(out, "band_5GHz: supported\n");
+    if (cap->ax_support)
+        fprintf(out, "ax: supported\n");
+    if (cap->be_support)
+        fprintf(out, "be: supported\n");
+    if (cap->band_6GHz_support)
+        fprintf(out, "band_6GHz: supported\n");
+    if (cap->width_80MHz_support)
+        fprintf(out, "width_80MHz: supported\n");
+    if (cap->width_160MHz_support)
+        fprintf(out, "width_160MHz: supported\n");
+    if (cap->width_320MHz_support)
+        fprintf(out, "width_320MHz: supported\n");
+    if (cap->spatial_streams)
+        fprintf(out, "spatial_streams: %u\n", cap->spatial_streams);
+    if (cap->max_phy_rate)
+        fprintf(out, "max_phy_rate_mbps: %u\n", cap->max_phy_rate);
+}
 
-	err = nl_send_auto_complete(nlstate.nl_sock, msg);
-	if (err < 0)
-		goto out;
+static void print_iftypes(FILE *out, unsigned long long iftypes)
+{
+	unsigned int iftype;
 
-	err = 1;
-	cap.ac_support = 0;
-	cap.n_support = 0;
-	cap.bg_support = 0;
-	cap.band_5GHz_support = 0;
+	for (iftype = 0; iftype < sizeof(ifmodes) / sizeof(ifmodes[0]); iftype++)
+		if (iftypes & BIT(iftype))
+			fprintf(out, "%s: supported\n", ifmodes[iftype]);
+}
 
-	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, print_phy_handler, &cap);
+/* Ask nl80211 (and sysfs, and maybe lspci) and print the resource records
+ * to @out.
+ * @return 0 on success, a negative error code or 1 otherwise.
+ */
+static int print_resources(FILE *out)
+{
+	struct nl80211_state nlstate;
+	struct wiphy_table table;
+	struct wireless_capabilities cap;
+	unsigned long long iftypes = 0;
+	bool unidentified;
+	int err, i, j;
+	FILE *pci_fp;
 
-	while (err > 0)
-		nl_recvmsgs(nlstate.nl_sock, cb);
- out:
-	nl_cb_put(cb);
- out_free_msg:
-	nlmsg_free(msg);
+	err = nl80211_init(&nlstate);
+	if (err)
+		return 1;
 
+	/* One session: all the wiphys, then the interfaces on them */
+	table.n_wiphys = 0;
+	err = nl80211_dump(&nlstate, NL80211_CMD_GET_WIPHY, true,
+			   print_phy_handler, &table);
+	if (!err)
+		err = nl80211_dump(&nlstate, NL80211_CMD_GET_INTERFACE, false,
+				   print_iface_handler, &table);
 	if (err < 0)
 		fprintf(stderr, "command failed: %s (%d)\n", strerror(-err), err);
 
 	nl80211_cleanup(&nlstate);
 
+	unidentified = table.n_wiphys == 0;
     /* Try to guess the ac capabilities using heuristics (sometimes required
-       as some drivers don't expose all their wireless properties to libnl */
-    if (!cap.ac_support) {
+       as some drivers don't expose all their wireless properties to libnl),
+       from the IDs of the device of each radio */
+	for (i = 0; i < table.n_wiphys; i++) {
+		struct wiphy_info *wiphy = &table.wiphys[i];
+		get_device_ids(wiphy);
+		if (wiphy->cap.ac_support)
+			continue;
+		switch (device_heuristic_test(wiphy)) {
+		case 0:
+			wiphy->cap.ac_support = true;
+			break;
+		case -1:
+			unidentified = true;
+			break;
+		}
+	}
+
+	/* The first record is what all the radios support together */
+	memset(&cap, 0, sizeof(cap));
+	for (i = 0; i < table.n_wiphys; i++) {
+		const struct wireless_capabilities *c = &table.wiphys[i].cap;
+		cap.ac_support |= c->ac_support;
+		cap.n_support |= c->n_support;
+		cap.bg_support |= c->bg_support;
+		cap.band_5GHz_support |= c->band_5GHz_support;
+		cap.ax_support |= c->ax_support;
+		cap.be_support |= c->be_support;
+		cap.band_6GHz_support |= c->band_6GHz_support;
+		cap.width_80MHz_support |= c->width_80MHz_support;
+		cap.width_160MHz_support |= c->width_160MHz_support;
+		cap.width_320MHz_support |= c->width_320MHz_support;
+		update_rate(&cap, c->spatial_streams, c->max_phy_rate);
+		iftypes |= table.wiphys[i].iftypes;
+	}
+	print_iftypes(out, iftypes);
+
+    /* As a last resort, when there's a radio we couldn't identify (or none
+       at all), ask lspci, which costs a walk of the whole PCI bus */
+    if (!cap.ac_support && unidentified) {
         pci_fp = popen("lspci -nnv", "r");
         if (!pci_fp) {
             perror("Something is wrong with lspci");
@@ -275,14 +873,311 @@ int main(int argc, char **argv)
             cap.ac_support = true;
         pclose(pci_fp);
     }
-    if (cap.ac_support)
-        printf("ac: supported\n");
-    if (cap.n_support)
-        printf("n: supported\n");
-    if (cap.bg_support)
-        printf("bg: supported\n");
-    if (cap.band_5GHz_support)
-        printf("band_5GHz: supported\n");
+    print_capabilities(out, &cap);
+
+	/* Then one record per radio */
+	for (i = 0; i < table.n_wiphys; i++) {
+		struct wiphy_info *wiphy = &table.wiphys[i];
+		fprintf(out, "\nwiphy: %s\n", wiphy->name);
+		fprintf(out, "wiphy_index: %u\n", wiphy->index);
+		if (wiphy->bus)
+			fprintf(out, "%s_id: %04x:%04x\n", wiphy->bus, wiphy->vendor,
+			       wiphy->device);
+		if (wiphy->n_interfaces) {
+			fprintf(out, "interfaces:");
+			for (j = 0; j < wiphy->n_interfaces; j++)
+				fprintf(out, " %s", wiphy->interfaces[j]);
+			fprintf(out, "\n");
+		}
+		print_iftypes(out, wiphy->iftypes);
+		print_capabilities(out, &wiphy->cap);
+	}
 
 	return err;
 }
+
+/* Optional cache of the output (-c FILE). What we print depends on the
+ * hardware and on the regulatory domain, which decides the channels that
+ * are enabled, so the cache is keyed on what would change it: this binary,
+ * the kernel release, the regulatory domains and, for every phy in sysfs,
+ * its MAC address, device IDs, driver, firmware version and interfaces.
+ * Building the key reads sysfs, asks ethtool for the firmware and nl80211
+ * for the regulatory domains, which is much less than the wiphy dump. */
+#define CACHE_MAGIC "# 80211_resource cache 2\n"
+#define CACHE_END "--\n"
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* First line of a sysfs file, "unknown" if it can't be read */
+static void read_line(const char *path, char *buf, size_t len)
+{
+	FILE *fp = fopen(path, "r");
+
+	snprintf(buf, len, "unknown");
+	if (fp) {
+		if (fgets(buf, len, fp))
+			buf[strcspn(buf, "\n")] = '\0';
+		fclose(fp);
+	}
+}
+
+/* Firmware version of a network interface, through ethtool */
+static void firmware_version(const char *ifname, char *buf, size_t len)
+{
+	struct ethtool_drvinfo drvinfo;
+	struct ifreq ifr;
+	int fd;
+
+	snprintf(buf, len, "unknown");
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return;
+	memset(&drvinfo, 0, sizeof(drvinfo));
+	memset(&ifr, 0, sizeof(ifr));
+	drvinfo.cmd = ETHTOOL_GDRVINFO;
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	ifr.ifr_data = (void *)&drvinfo;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == 0 && drvinfo.fw_version[0])
+		snprintf(buf, len, "%s", drvinfo.fw_version);
+	close(fd);
+}
+
+static void print_phy_key(FILE *out, const char *phy)
+{
+	struct wiphy_info wiphy;
+	char path[PATH_MAX], link[PATH_MAX], buf[64];
+	struct dirent *entry;
+	ssize_t n;
+	DIR *dir;
+
+	fprintf(out, "%s", phy);
+	snprintf(path, sizeof(path), "/sys/class/ieee80211/%s/macaddress", phy);
+	read_line(path, buf, sizeof(buf));
+	fprintf(out, " mac=%s", buf);
+
+	memset(&wiphy, 0, sizeof(wiphy));
+	snprintf(wiphy.name, sizeof(wiphy.name), "%s", phy);
+	get_device_ids(&wiphy);
+	if (wiphy.bus)
+		fprintf(out, " %s=%04x:%04x", wiphy.bus, wiphy.vendor,
+			wiphy.device);
+
+	snprintf(path, sizeof(path), "/sys/class/ieee80211/%s/device/driver", phy);
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n > 0) {
+		link[n] = '\0';
+		fprintf(out, " driver=%s", strrchr(link, '/') ?
+			strrchr(link, '/') + 1 : link);
+	}
+
+	/* the firmware version is only known through an interface */
+	snprintf(path, sizeof(path), "/sys/class/ieee80211/%s/device/net", phy);
+	dir = opendir(path);
+	if (dir) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.')
+				continue;
+			firmware_version(entry->d_name, buf, sizeof(buf));
+			fprintf(out, " if=%s fw=%s", entry->d_name, buf);
+		}
+		closedir(dir);
+	}
+	fprintf(out, "\n");
+}
+
+static int print_reg_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlattr *tb_msg[NL80211_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	FILE *out = arg;
+
+	nla_parse(tb_msg, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+	if (!tb_msg[NL80211_ATTR_REG_ALPHA2])
+		return NL_SKIP;
+	/* the global domain, then those of self-managed wiphys */
+	if (tb_msg[NL80211_ATTR_WIPHY])
+		fprintf(out, " wiphy%u=",
+			nla_get_u32(tb_msg[NL80211_ATTR_WIPHY]));
+	else
+		fprintf(out, " ");
+	fprintf(out, "%.2s", nla_get_string(tb_msg[NL80211_ATTR_REG_ALPHA2]));
+	return NL_SKIP;
+}
+
+/* The regulatory domains in use. Kernels too old to dump them only give
+ * the one cfg80211 was loaded with. */
+static void print_reg_key(FILE *out)
+{
+	struct nl80211_state nlstate;
+	char *regs = NULL, buf[16];
+	size_t len = 0;
+	FILE *reg_out;
+	int err = -ENOMEM;
+
+	reg_out = open_memstream(&regs, &len);
+	if (reg_out && nl80211_init(&nlstate) == 0) {
+		err = nl80211_dump(&nlstate, NL80211_CMD_GET_REG, false,
+				   print_reg_handler, reg_out);
+		nl80211_cleanup(&nlstate);
+	}
+	if (reg_out)
+		fclose(reg_out);
+	if (err == 0 && len > 0) {
+		fprintf(out, "regdom=%s\n", regs + 1);
+	} else {
+		read_line("/sys/module/cfg80211/parameters/ieee80211_regdom",
+			  buf, sizeof(buf));
+		fprintf(out, "regdom=%s\n", buf);
+	}
+	free(regs);
+}
+
+/* The key of the current hardware and kernel, to be freed by the caller */
+static char *cache_key(void)
+{
+	struct utsname uts;
+	struct stat exe;
+	struct dirent *entry;
+	char *key = NULL, **phys = NULL;
+	size_t len = 0, n_phys = 0, i;
+	FILE *out;
+	DIR *dir;
+
+	out = open_memstream(&key, &len);
+	if (!out)
+		return NULL;
+	fprintf(out, CACHE_MAGIC);
+	/* a new build may print something else */
+	if (stat("/proc/self/exe", &exe) == 0)
+		fprintf(out, "binary=%lld.%09ld/%lld\n", (long long)exe.st_mtim.tv_sec,
+			exe.st_mtim.tv_nsec, (long long)exe.st_size);
+	if (uname(&uts) == 0)
+		fprintf(out, "kernel=%s\n", uts.release);
+	print_reg_key(out);
+
+	dir = opendir("/sys/class/ieee80211");
+	if (dir) {
+		while ((entry = readdir(dir)) != NULL) {
+			char **p;
+			if (entry->d_name[0] == '.')
+				continue;
+			p = realloc(phys, (n_phys + 1) * sizeof(char *));
+			if (!p)
+				break;
+			phys = p;
+			phys[n_phys++] = strdup(entry->d_name);
+		}
+		closedir(dir);
+	}
+	qsort(phys, n_phys, sizeof(char *), compare_names);
+	for (i = 0; i < n_phys; i++) {
+		print_phy_key(out, phys[i]);
+		free(phys[i]);
+	}
+	free(phys);
+	fprintf(out, CACHE_END);
+	fclose(out);
+	return key;
+}
+
+/* Print the cached output if it was made with this @key.
+ * @return 0 on success 1 otherwise.
+ */
+static int read_cache(const char *path, const char *key)
+{
+	size_t key_len = strlen(key), len;
+	char buf[4096];
+	int ret = 1;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 1;
+	len = fread(buf, 1, sizeof(buf), fp);
+	if (len >= key_len && memcmp(buf, key, key_len) == 0) {
+		fwrite(buf + key_len, 1, len - key_len, stdout);
+		while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+			fwrite(buf, 1, len, stdout);
+		ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/* Save @output under @key. Only an optimisation, so failing is quiet. */
+static void write_cache(const char *path, const char *key, const char *output)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >=
+	    (int)sizeof(tmp))
+		return;
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return;
+	fputs(key, fp);
+	fputs(output, fp);
+	/* the rename makes the new cache appear whole or not at all */
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-c FILE] [-h]\n", name);
+	printf("  -c: answer from this cache file if the hardware, drivers,\n"
+	       "      firmware, regulatory domain, kernel and this program\n"
+	       "      haven't changed, else update it\n");
+	printf("  -h: this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *cache = NULL;
+	char *key = NULL, *output = NULL;
+	size_t len = 0;
+	FILE *out;
+	int err, opt;
+
+	while ((opt = getopt(argc, argv, "c:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (cache) {
+		key = cache_key();
+		if (key && read_cache(cache, key) == 0) {
+			free(key);
+			return 0;
+		}
+	}
+
+	out = open_memstream(&output, &len);
+	if (!out) {
+		perror("open_memstream");
+		return 1;
+	}
+	err = print_resources(out);
+	fclose(out);
+	fputs(output, stdout);
+	if (key && err == 0)
+		write_cache(cache, key, output);
+	free(output);
+	free(key);
+
+	return err < 0 ? -err : err;
+}